@@ -0,0 +1,335 @@
+/*
+ * Throughput and latency sweep over /dev/cryptiface.
+ *
+ * For every available algorithm, buffer size (16 B to 1 MiB) and
+ * submission path it times encryption and decryption and prints one line
+ * with MB/s, ops/s and the p50/p99 latency of a single call.  A call is
+ * one write() + read() pair, one batch ioctl or one ring enter; the
+ * latter two carry several buffers, all counted as ops.
+ *
+ * usage: bench [-a algorithm] [-p rw|batch|ring] [-s max_size] [-t seconds]
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "cryptiface.h"
+
+enum { MIN_SIZE = 16, MAX_SIZE = 1 << 20 };
+// buffers per batch ioctl or ring enter, also bounded by BATCH_BYTES
+enum { BATCH_COUNT = 16, BATCH_BYTES = 4 << 20 };
+enum { RING_ENTRIES = 32 };
+// latency samples kept per measurement
+enum { MAX_SAMPLES = 1 << 16 };
+
+struct algorithm {
+  int id;
+  const char *name;
+  const char *key;
+  size_t iv_size;
+};
+
+static const struct algorithm algorithms[] = {
+  { CRYPTIFACE_ALG_DES, "des", "3132333435363738", 0 },
+  { CRYPTIFACE_ALG_AES_ECB, "aes-ecb", "000102030405060708090a0b0c0d0e0f",
+    0 },
+  { CRYPTIFACE_ALG_AES_CBC, "aes-cbc", "000102030405060708090a0b0c0d0e0f",
+    16 },
+  { CRYPTIFACE_ALG_AES_CTR, "aes-ctr", "000102030405060708090a0b0c0d0e0f",
+    16 },
+  { CRYPTIFACE_ALG_AES_XTS, "aes-xts",
+    "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f", 16 },
+  { CRYPTIFACE_ALG_CHACHA20, "chacha20",
+    "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f", 16 },
+};
+
+struct bench {
+  int fd;
+  int algorithm;
+  int key_id;
+  size_t iv_size;
+  unsigned long long nonce;
+  bool encrypt;
+  size_t size;
+  char *in;
+  char *out;
+  struct __cryptiface_batch_entry entries[BATCH_COUNT];
+  void *ring_map;
+  size_t ring_map_size;
+};
+
+struct path {
+  const char *name;
+  // returns the number of buffers transformed, -1 on error
+  int (*run)(struct bench *b);
+};
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+compare_doubles(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static int
+batch_count(size_t size)
+{
+  int count = BATCH_BYTES / size;
+  if(count > BATCH_COUNT)
+    count = BATCH_COUNT;
+  return count > 0 ? count : 1;
+}
+
+// a fresh IV for every message, as CTR and ChaCha20 require
+static void
+next_iv(struct bench *b, unsigned char *iv)
+{
+  memset(iv, 0, CRYPTIFACE_MAX_IV_SIZE);
+  b->nonce++;
+  memcpy(iv, &b->nonce, sizeof(b->nonce));
+}
+
+static int
+run_rw(struct bench *b)
+{
+  unsigned char iv[CRYPTIFACE_MAX_IV_SIZE];
+  ssize_t len;
+  if(b->iv_size > 0) {
+    next_iv(b, iv);
+    if(cryptiface_setiv(b->fd, iv, b->iv_size))
+      return -1;
+  }
+  if(write(b->fd, b->in, b->size) != (ssize_t)b->size)
+    return -1;
+  len = read(b->fd, b->out, b->size + MIN_SIZE);
+  if(len < (ssize_t)b->size)
+    return -1;
+  return 1;
+}
+
+static int
+run_batch(struct bench *b)
+{
+  int i, count = batch_count(b->size);
+  for(i = 0; i < count; i++) {
+    b->entries[i].context_id = b->key_id;
+    b->entries[i].encrypt = b->encrypt;
+    b->entries[i].in = b->in + i * b->size;
+    b->entries[i].out = b->out + i * (b->size + MIN_SIZE);
+    b->entries[i].len = b->size;
+    next_iv(b, b->entries[i].iv);
+    b->entries[i].result = 0;
+  }
+  if(cryptiface_batch(b->fd, b->algorithm, b->entries, count) != count)
+    return -1;
+  for(i = 0; i < count; i++)
+    if(b->entries[i].result < 0) {
+      errno = -b->entries[i].result;
+      return -1;
+    }
+  return count;
+}
+
+static int
+run_ring(struct bench *b)
+{
+  struct __cryptiface_ring_header *header = b->ring_map;
+  struct __cryptiface_sqe *sqes =
+    (void *)((char *)b->ring_map + header->sq_offset);
+  struct __cryptiface_cqe *cqes =
+    (void *)((char *)b->ring_map + header->cq_offset);
+  unsigned int mask = header->entries - 1;
+  int i, count = batch_count(b->size), done = 0;
+
+  if((size_t)count * b->size > header->data_size)
+    count = header->data_size / b->size;
+  for(i = 0; i < count; i++) {
+    struct __cryptiface_sqe *sqe = &sqes[header->sq_tail & mask];
+    sqe->user_data = i;
+    sqe->offset = i * b->size;
+    sqe->len = b->size;
+    next_iv(b, sqe->iv);
+    __atomic_store_n(&header->sq_tail, header->sq_tail + 1,
+                     __ATOMIC_RELEASE);
+  }
+  while(done < count) {
+    unsigned int tail;
+    if(cryptiface_ring_enter(b->fd) < 0)
+      return -1;
+    tail = __atomic_load_n(&header->cq_tail, __ATOMIC_ACQUIRE);
+    for(; header->cq_head != tail; header->cq_head++, done++)
+      if(cqes[header->cq_head & mask].res < 0) {
+        errno = -cqes[header->cq_head & mask].res;
+        return -1;
+      }
+  }
+  return count;
+}
+
+static const struct path paths[] = {
+  { "rw", run_rw },
+  { "batch", run_batch },
+  { "ring", run_ring },
+};
+
+static int
+setup_ring(struct bench *b)
+{
+  if(cryptiface_ring_setup(b->fd, RING_ENTRIES, BATCH_BYTES,
+                           &b->ring_map_size)) {
+    perror("cryptiface_ring_setup()");
+    return -1;
+  }
+  b->ring_map = mmap(NULL, b->ring_map_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, b->fd, 0);
+  if(MAP_FAILED == b->ring_map) {
+    perror("mmap()");
+    b->ring_map = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+static void
+measure(struct bench *b, const struct path *path, const char *alg_name,
+        double seconds, double *samples)
+{
+  double start, end, deadline, elapsed;
+  long ops = 0;
+  int calls = 0, n;
+
+  // warm the page pool and the cached tfm
+  if(path->run(b) < 0) {
+    fprintf(stderr, "%s %s %s %zu: %s\n", alg_name, path->name,
+            b->encrypt ? "enc" : "dec", b->size, strerror(errno));
+    return;
+  }
+
+  deadline = now() + seconds;
+  start = now();
+  do {
+    double t = now();
+    n = path->run(b);
+    if(n < 0) {
+      perror(path->name);
+      return;
+    }
+    ops += n;
+    end = now();
+    if(calls < MAX_SAMPLES)
+      samples[calls] = end - t;
+    calls++;
+  } while(end < deadline);
+  elapsed = end - start;
+
+  n = calls < MAX_SAMPLES ? calls : MAX_SAMPLES;
+  qsort(samples, n, sizeof(*samples), compare_doubles);
+  printf("%-9s %-6s %s %8zu %10.1f %12.0f %10.1f %10.1f\n",
+         alg_name, path->name, b->encrypt ? "enc" : "dec", b->size,
+         ops * b->size / elapsed / 1e6, ops / elapsed,
+         samples[n / 2] * 1e6, samples[n * 99 / 100] * 1e6);
+  fflush(stdout);
+}
+
+static void
+usage(const char *prog)
+{
+  fprintf(stderr, "usage: %s [-a algorithm] [-p rw|batch|ring] "
+          "[-s max_size] [-t seconds]\n", prog);
+  exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+  const char *only_alg = NULL, *only_path = NULL;
+  size_t max_size = MAX_SIZE;
+  double seconds = 0.5;
+  struct bench b;
+  double *samples;
+  size_t a, p;
+  int opt;
+
+  while((opt = getopt(argc, argv, "a:p:s:t:")) != -1) {
+    switch(opt) {
+    case 'a': only_alg = optarg; break;
+    case 'p': only_path = optarg; break;
+    case 's': max_size = strtoul(optarg, NULL, 0); break;
+    case 't': seconds = atof(optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+  if(max_size < MIN_SIZE || max_size > MAX_SIZE || seconds <= 0)
+    usage(argv[0]);
+
+  memset(&b, 0, sizeof(b));
+  b.fd = open("/dev/cryptiface", O_RDWR);
+  if(-1 == b.fd) {
+    perror("open()");
+    return 1;
+  }
+  b.in = malloc(BATCH_COUNT * MAX_SIZE);
+  b.out = malloc(BATCH_COUNT * (MAX_SIZE + MIN_SIZE));
+  samples = malloc(MAX_SAMPLES * sizeof(*samples));
+  if(NULL == b.in || NULL == b.out || NULL == samples) {
+    perror("malloc()");
+    return 1;
+  }
+  memset(b.in, 'A', BATCH_COUNT * MAX_SIZE);
+  if(setup_ring(&b))
+    fprintf(stderr, "skipping the ring path\n");
+
+  printf("%-9s %-6s %s %8s %10s %12s %10s %10s\n", "alg", "path", "dir",
+         "size", "MB/s", "ops/s", "p50(us)", "p99(us)");
+  for(a = 0; a < sizeof(algorithms) / sizeof(algorithms[0]); a++) {
+    const struct algorithm *alg = &algorithms[a];
+    if(only_alg != NULL && strcmp(only_alg, alg->name))
+      continue;
+    b.algorithm = alg->id;
+    b.iv_size = alg->iv_size;
+    b.key_id = cryptiface_addkey(b.fd, alg->id, alg->key);
+    if(-1 == b.key_id) {
+      fprintf(stderr, "%s: %s, skipped\n", alg->name, strerror(errno));
+      continue;
+    }
+    for(p = 0; p < sizeof(paths) / sizeof(paths[0]); p++) {
+      if(only_path != NULL && strcmp(only_path, paths[p].name))
+        continue;
+      if(paths[p].run == run_ring && NULL == b.ring_map)
+        continue;
+      for(b.size = MIN_SIZE; b.size <= max_size; b.size *= 4) {
+        int dir;
+        for(dir = 0; dir < 2; dir++) {
+          b.encrypt = dir == 0;
+          if(cryptiface_setcurrent(b.fd, alg->id, b.key_id, b.encrypt)) {
+            perror("cryptiface_setcurrent()");
+            return 1;
+          }
+          measure(&b, &paths[p], alg->name, seconds, samples);
+        }
+      }
+    }
+    cryptiface_delkey(b.fd, alg->id, b.key_id);
+  }
+  return 0;
+}
@@ -49,3 +49,75 @@ cryptiface_sizeresults(int fd, size_t *res, int n)
   op_info.count = n;
   return ioctl(fd, CRYPTIFACE_IOCTL_SIZERESULTS, &op_info);
 }
+
+int
+cryptiface_ring_setup(int fd, unsigned int entries, size_t data_size,
+                      size_t *mmap_size)
+{
+  struct __cryptiface_ring_setup_op op_info;
+  int err;
+  op_info.entries = entries;
+  op_info.data_size = data_size;
+  op_info.mmap_size = 0;
+  err = ioctl(fd, CRYPTIFACE_IOCTL_RING_SETUP, &op_info);
+  if(err == 0 && mmap_size != NULL)
+    *mmap_size = op_info.mmap_size;
+  return err;
+}
+
+int
+cryptiface_ring_enter(int fd)
+{
+  return ioctl(fd, CRYPTIFACE_IOCTL_RING_ENTER);
+}
+
+int
+cryptiface_batch(int fd, int algorithm,
+                 struct __cryptiface_batch_entry *entries, int count)
+{
+  struct __cryptiface_batch_op op_info;
+  op_info.algorithm = algorithm;
+  op_info.entries = entries;
+  op_info.count = count;
+  return ioctl(fd, CRYPTIFACE_IOCTL_BATCH, &op_info);
+}
+
+int
+cryptiface_setflags(int fd, unsigned int flags)
+{
+  struct __cryptiface_setflags_op op_info;
+  op_info.flags = flags;
+  return ioctl(fd, CRYPTIFACE_IOCTL_SETFLAGS, &op_info);
+}
+
+int
+cryptiface_setiv(int fd, const unsigned char *iv, size_t iv_len)
+{
+  struct __cryptiface_setiv_op op_info;
+  op_info.iv = iv;
+  op_info.iv_len = iv_len;
+  return ioctl(fd, CRYPTIFACE_IOCTL_SETIV, &op_info);
+}
+
+int
+cryptiface_resultstat(int fd, struct __cryptiface_resultstat_op *stat)
+{
+  return ioctl(fd, CRYPTIFACE_IOCTL_RESULTSTAT, stat);
+}
+
+int
+cryptiface_stream(int fd, int enable, const unsigned char *iv, size_t iv_len)
+{
+  struct __cryptiface_stream_op op_info;
+  op_info.enable = enable;
+  op_info.iv = iv;
+  op_info.iv_len = iv_len;
+  return ioctl(fd, CRYPTIFACE_IOCTL_STREAM, &op_info);
+}
+
+int
+cryptiface_stats(int fd, struct __cryptiface_stats *stats)
+{
+  stats->header.size = sizeof(*stats);
+  return ioctl(fd, CRYPTIFACE_IOCTL_STATS, stats);
+}
@@ -10,5 +10,16 @@ int cryptiface_addkey(int fd, int algorithm, const char *key);
 int cryptiface_delkey(int fd, int algorithm, int id);
 int cryptiface_numresults(int fd);
 int cryptiface_sizeresults(int fd, size_t *res, int n);
+int cryptiface_ring_setup(int fd, unsigned int entries, size_t data_size,
+                          size_t *mmap_size);
+int cryptiface_ring_enter(int fd);
+int cryptiface_batch(int fd, int algorithm,
+                     struct __cryptiface_batch_entry *entries, int count);
+int cryptiface_setflags(int fd, unsigned int flags);
+int cryptiface_setiv(int fd, const unsigned char *iv, size_t iv_len);
+int cryptiface_resultstat(int fd, struct __cryptiface_resultstat_op *stat);
+int cryptiface_stream(int fd, int enable, const unsigned char *iv,
+                      size_t iv_len);
+int cryptiface_stats(int fd, struct __cryptiface_stats *stats);
 
 #endif
@@ -4,23 +4,106 @@
 #include <linux/ctype.h>
 #include <linux/sched.h>
 #include <linux/cdev.h>
+#include <linux/err.h>
+#include <linux/kref.h>
+#include <linux/crypto.h>
+#include <linux/hash.h>
+#include <linux/rculist.h>
+#include <linux/idr.h>
 
 #include "crypto_structures.h"
+#include "crypto_ioctlmagic.h"
+#include "crypto_cipher.h"
 #include "crypto_algorithm.h"
+#include "crypto_stats.h"
+
+static struct crypto_algorithm_info algorithms[CRYPTIFACE_ALG_INVALID] = {
+	[CRYPTIFACE_ALG_DES] = {
+		.name = "des", .driver = "ecb(des)", .key_len_step = 8,
+		.split = CRYPTO_SPLIT_BLOCKS },
+	[CRYPTIFACE_ALG_AES_ECB] = {
+		.name = "aes-ecb", .driver = "ecb(aes)", .key_len_step = 8,
+		.split = CRYPTO_SPLIT_BLOCKS },
+	[CRYPTIFACE_ALG_AES_CBC] = {
+		.name = "aes-cbc", .driver = "cbc(aes)", .key_len_step = 8,
+		.split = CRYPTO_SPLIT_CHAIN },
+	[CRYPTIFACE_ALG_AES_CTR] = {
+		.name = "aes-ctr", .driver = "ctr(aes)", .key_len_step = 8,
+		.split = CRYPTO_SPLIT_COUNTER, .unique_iv = true },
+	// a piece past the first block has no IV that yields its tweaks
+	[CRYPTIFACE_ALG_AES_XTS] = {
+		.name = "aes-xts", .driver = "xts(aes)", .key_len_step = 16,
+		.split = CRYPTO_SPLIT_NONE },
+	[CRYPTIFACE_ALG_CHACHA20] = {
+		.name = "chacha20", .driver = "chacha20", .key_len_step = 32,
+		.split = CRYPTO_SPLIT_NONE, .unique_iv = true },
+};
+
+// fills in the key limits of the transform, false if there is none
+static bool probe_crypto_algorithm(struct crypto_algorithm_info *info)
+{
+	struct crypto_ablkcipher *tfm;
+	struct crypto_alg *alg;
+
+	tfm = crypto_alloc_ablkcipher(info->driver, 0, 0);
+	if(IS_ERR(tfm)) {
+		return false;
+	}
+	// synchronous ciphers are wrapped, their limits stay where they were
+	alg = crypto_ablkcipher_tfm(tfm)->__crt_alg;
+	if((alg->cra_flags & CRYPTO_ALG_TYPE_MASK)
+	   == CRYPTO_ALG_TYPE_BLKCIPHER) {
+		info->min_key_len = alg->cra_blkcipher.min_keysize;
+		info->max_key_len = alg->cra_blkcipher.max_keysize;
+	} else {
+		info->min_key_len = alg->cra_ablkcipher.min_keysize;
+		info->max_key_len = alg->cra_ablkcipher.max_keysize;
+	}
+	crypto_free_ablkcipher(tfm);
+	// contexts only have room for this much
+	info->max_key_len = min_t(int, info->max_key_len,
+				  CRYPTO_MAX_KEY_LENGTH);
+	return info->min_key_len > 0 && info->min_key_len <= info->max_key_len;
+}
+
+// returns the number of algorithms the crypto API can provide
+int probe_crypto_algorithms(void)
+{
+	int i, count = 0;
+	for(i = 0; i<CRYPTIFACE_ALG_INVALID; i++) {
+		struct crypto_algorithm_info *info = &algorithms[i];
+		info->available = probe_crypto_algorithm(info);
+		if(info->available) {
+			count++;
+		} else {
+			printk(KERN_INFO "%s unavailable\n", info->driver);
+		}
+	}
+	return count;
+}
+
+const struct crypto_algorithm_info* get_alg_info(int algorithm)
+{
+	if(algorithm < 0 || algorithm >= CRYPTIFACE_ALG_INVALID
+	   || !algorithms[algorithm].available) {
+		return NULL;
+	}
+	return &algorithms[algorithm];
+}
 
 static void initialize_crypto_db(struct crypto_db *db, uid_t uid)
 {
-	int i;
 	INIT_LIST_HEAD(&db->new_contexts_queue);
 	init_waitqueue_head(&db->new_context_created_waitqueue);
 	spin_lock_init(&db->new_contexts_list_lock);
 	mutex_init(&db->new_context_wait_mutex);
 	db->uid = uid;
-	memset(db->contexts, 0,
-	       CRYPTO_MAX_CONTEXT_COUNT*sizeof(struct crypto_context));
-	for(i = 0; i<CRYPTO_MAX_CONTEXT_COUNT; i++) {
-		mutex_init(&db->contexts[i].context_mutex);
-	}
+	idr_init(&db->contexts);
+	spin_lock_init(&db->contexts_lock);
+	spin_lock_init(&db->queue_space_lock);
+	db->queued_bytes = 0;
+	db->queued_results = 0;
+	init_waitqueue_head(&db->queue_space_waitqueue);
 }
 
 struct crypto_db* create_crypto_db(uid_t uid)
@@ -33,26 +116,88 @@ struct crypto_db* create_crypto_db(uid_t uid)
 	return db;
 }
 
-struct crypto_db* get_or_create_crypto_db(struct list_head *dbs, uid_t uid)
+static int put_db_context(int id, void *p, void *data)
 {
-	struct crypto_db *db_entry;
-	struct list_head *head;
-	list_for_each(head, dbs) {
-		db_entry = list_entry(head, struct crypto_db, db_list);
+	put_context(p);
+	return 0;
+}
+
+void destroy_crypto_db(struct crypto_db *db)
+{
+	struct new_context_info *info, *tmp;
+	// drops the references the idr holds
+	idr_for_each(&db->contexts, put_db_context, NULL);
+	idr_destroy(&db->contexts);
+	list_for_each_entry_safe(info, tmp, &db->new_contexts_queue, contexts) {
+		kfree(info);
+	}
+	kfree(db);
+}
+
+static struct list_head* crypto_db_bucket(struct cryptodev_t *dev, uid_t uid)
+{
+	return &dev->crypto_dbs[hash_32(uid, CRYPTO_DB_HASH_BITS)];
+}
+
+struct crypto_db* find_crypto_db(struct cryptodev_t *dev, uid_t uid)
+{
+	struct crypto_db *db_entry, *found = NULL;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(db_entry, crypto_db_bucket(dev, uid),
+				db_list) {
 		if(db_entry->uid == uid) {
-			return db_entry;
+			found = db_entry;
+			break;
 		}
 	}
-	// db for given uid not found
-	printk(KERN_INFO "Creating new crypto db for uid %d\n", uid);
-	db_entry = create_crypto_db(uid);
+	rcu_read_unlock();
+	// dbs live until module exit, so the pointer stays valid
+	return found;
+}
+
+struct crypto_db* get_or_create_crypto_db(struct cryptodev_t *dev, uid_t uid)
+{
+	struct crypto_db *db_entry = find_crypto_db(dev, uid);
+	if(NULL != db_entry) {
+		return db_entry;
+	}
+
+	mutex_lock(&dev->crypto_dbs_mutex);
+	// somebody may have added it since we looked
+	db_entry = find_crypto_db(dev, uid);
 	if(NULL == db_entry) {
-		return NULL;
+		printk(KERN_INFO "Creating new crypto db for uid %d\n", uid);
+		db_entry = create_crypto_db(uid);
+		if(NULL != db_entry) {
+			list_add_rcu(&db_entry->db_list,
+				     crypto_db_bucket(dev, uid));
+		}
 	}
-	list_add(&db_entry->db_list, dbs);
+	mutex_unlock(&dev->crypto_dbs_mutex);
 	return db_entry;
 }
 
+void get_crypto_queue_totals(struct cryptodev_t *dev, __u64 *results,
+			     __u64 *bytes)
+{
+	struct crypto_db *db;
+	int i;
+
+	*results = 0;
+	*bytes = 0;
+	rcu_read_lock();
+	for(i = 0; i<CRYPTO_DB_HASH_SIZE; i++) {
+		list_for_each_entry_rcu(db, &dev->crypto_dbs[i], db_list) {
+			spin_lock(&db->queue_space_lock);
+			*results += db->queued_results;
+			*bytes += db->queued_bytes;
+			spin_unlock(&db->queue_space_lock);
+		}
+	}
+	rcu_read_unlock();
+}
+
 int get_key_index(char *buf) {
 	unsigned long key;
 	if(strict_strtoul(buf, 10, &key)) {
@@ -65,10 +210,15 @@ int get_key_index(char *buf) {
 	}
 }
 
-bool is_valid_key(char *buf, int len)
+bool is_valid_key(int algorithm, char *buf, int len)
 {
+	const struct crypto_algorithm_info *info = get_alg_info(algorithm);
 	int i;
-	if(len != 2*CRYPTO_MAX_KEY_LENGTH) {
+	if(NULL == info || len % 2 != 0) {
+		return false;
+	}
+	if(len/2 < info->min_key_len || len/2 > info->max_key_len
+	   || (len/2 - info->min_key_len) % info->key_len_step != 0) {
 		return false;
 	}
 	for(i = 0; i<len; i++) {
@@ -92,61 +242,145 @@ static void hex_string_to_bytes(char *hex, int hex_len,
 }
 
 
-int add_key_to_db(struct crypto_db *db, int ix,
-			 char *buf, int len)
+static void release_context(struct kref *ref)
 {
-	struct new_context_info *info;
+	struct crypto_context *context =
+		container_of(ref, struct crypto_context, ref);
+	if(NULL != context->cipher) {
+		put_cryptiface_cipher(context->cipher);
+	}
+	kfree(context);
+}
+
+void put_context(struct crypto_context *context)
+{
+	kref_put(&context->ref, release_context);
+}
+
+struct crypto_context* get_context(struct crypto_db *db, int id)
+{
+	struct crypto_context *context;
+	spin_lock(&db->contexts_lock);
+	context = idr_find(&db->contexts, id);
+	if(NULL != context) {
+		kref_get(&context->ref);
+	}
+	spin_unlock(&db->contexts_lock);
+	return context;
+}
+
+struct crypto_context* get_next_context(struct crypto_db *db, int *id)
+{
+	struct crypto_context *context;
+	spin_lock(&db->contexts_lock);
+	context = idr_get_next(&db->contexts, id);
+	if(NULL != context) {
+		kref_get(&context->ref);
+	}
+	spin_unlock(&db->contexts_lock);
+	return context;
+}
 
-	printk(KERN_INFO "adding key to db, ix %d, len %d", ix, len/2);
-	memset(db->contexts[ix].key, 0, len/2);
-	hex_string_to_bytes(buf, len, db->contexts[ix].key);
-	db->contexts[ix].key_len = len/2;
-	db->contexts[ix].added_time = get_seconds();
-	db->contexts[ix].encoded_count = 0;
-	db->contexts[ix].decoded_count = 0;
+int add_key_to_db(struct crypto_db *db, int algorithm, char *buf, int len)
+{
+	struct crypto_context *context;
+	struct new_context_info *info;
+	int id;
 
+	context = kzalloc(sizeof(*context), GFP_KERNEL);
+	if(NULL == context) {
+		return -ENOMEM;
+	}
 	info = kmalloc(sizeof(*info), GFP_KERNEL);
 	if(NULL == info) {
+		kfree(context);
 		return -ENOMEM;
 	}
-	info->ix = ix;
+	kref_init(&context->ref);
+	mutex_init(&context->context_mutex);
+	context->algorithm = algorithm;
+	hex_string_to_bytes(buf, len, context->key);
+	context->key_len = len/2;
+	context->added_time = get_seconds();
+	context->is_active = true;
+
+	// the context is complete before lookups can find it
+	idr_preload(GFP_KERNEL);
+	spin_lock(&db->contexts_lock);
+	id = idr_alloc(&db->contexts, context, 0, CRYPTO_MAX_CONTEXT_COUNT,
+		       GFP_NOWAIT);
+	if(id >= 0) {
+		context->id = id;
+	}
+	spin_unlock(&db->contexts_lock);
+	idr_preload_end();
+	if(id < 0) {
+		kfree(info);
+		kfree(context);
+		return id;
+	}
+	printk(KERN_INFO "adding key to db, id %d, len %d", id, len/2);
+
+	info->ix = id;
 	spin_lock(&db->new_contexts_list_lock);
 	list_add_tail(&info->contexts, &db->new_contexts_queue);
 	spin_unlock(&db->new_contexts_list_lock);
 	wake_up_interruptible(&db->new_context_created_waitqueue);
-	db->contexts[ix].is_active = true;
-	return 0;
+	return id;
 }
 
-int delete_key_from_db(struct crypto_db* db, int ix) {
-	if(!db->contexts[ix].is_active) {
-		// context is inactive
+int delete_key_from_db(struct crypto_db* db, int id) {
+	struct crypto_context *context;
+
+	spin_lock(&db->contexts_lock);
+	context = idr_find(&db->contexts, id);
+	if(NULL != context) {
+		idr_remove(&db->contexts, id);
+	}
+	spin_unlock(&db->contexts_lock);
+	if(NULL == context) {
 		return -EINVAL;
 	}
 
-	db->contexts[ix].is_active = false;
+	// users that looked the context up before keep it alive, but see it
+	// inactive from now on
+	mutex_lock(&context->context_mutex);
+	context->is_active = false;
+	if(NULL != context->cipher) {
+		// fds using the key keep their own references
+		put_cryptiface_cipher(context->cipher);
+		context->cipher = NULL;
+	}
+	mutex_unlock(&context->context_mutex);
+	put_context(context);
 	return 0;
 }
 
-int acquire_free_context_index(struct crypto_db* db) {
-	int i, ix = -ENOSPC;
-	for(i = 0; i<CRYPTO_MAX_CONTEXT_COUNT; i++) {
-		if(mutex_lock_interruptible(&db->contexts[i].context_mutex)) {
-			return -ERESTARTSYS;
-		}
-		if(!db->contexts[i].is_active) {
-			ix = i;
-			break;
+/*
+ * Returns a referenced transform keyed with the context's key, creating
+ * the cached one on first use.  Called with the context mutex held.
+ */
+struct cryptiface_cipher* get_context_cipher(struct crypto_context *context,
+					     int algorithm)
+{
+	struct cryptiface_cipher *cipher = context->cipher;
+	if(algorithm != context->algorithm) {
+		// the key was validated for its own algorithm only
+		return ERR_PTR(-EINVAL);
+	}
+	if(NULL == cipher) {
+		crypto_stats_count_event(CRYPTO_STAT_CIPHER_CACHE_MISS);
+		cipher = create_cryptiface_cipher(algorithm, context->key,
+						  context->key_len);
+		if(IS_ERR(cipher)) {
+			return cipher;
 		}
-		mutex_unlock(&db->contexts[i].context_mutex);
+		cipher->context_id = context->id;
+		context->cipher = cipher;
+	} else {
+		crypto_stats_count_event(CRYPTO_STAT_CIPHER_CACHE_HIT);
 	}
-	return ix;
+	get_cryptiface_cipher(cipher);
+	return cipher;
 }
 
-int acquire_context_index(struct crypto_db* db, int ix) {
-	return mutex_lock_interruptible(&db->contexts[ix].context_mutex);
-}
-
-void release_context_index(struct crypto_db* db, int ix) {
-	mutex_unlock(&db->contexts[ix].context_mutex);
-}
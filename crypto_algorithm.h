@@ -2,15 +2,65 @@
 
 // #include "crypto_structures.h"
 
+struct cryptodev_t;
+struct crypto_db;
+struct crypto_context;
+struct cryptiface_cipher;
+
+/*
+ * How a message may be cut into pieces at block boundaries:
+ * CRYPTO_SPLIT_BLOCKS pieces are independent, CRYPTO_SPLIT_COUNTER ones
+ * too once the IV is advanced by the blocks before the piece, and
+ * CRYPTO_SPLIT_CHAIN ones run in order, each from the IV the previous one
+ * left behind.
+ */
+enum crypto_alg_split {
+	CRYPTO_SPLIT_NONE,
+	CRYPTO_SPLIT_BLOCKS,
+	CRYPTO_SPLIT_COUNTER,
+	CRYPTO_SPLIT_CHAIN
+};
+
+struct crypto_algorithm_info {
+	const char *name;
+	const char *driver;
+	// the limits come from the transform when it is probed, the step
+	// from the table; the crypto API has none
+	int min_key_len;
+	int max_key_len;
+	int key_len_step;
+	enum crypto_alg_split split;
+	// a keystream mode: an IV used twice with a key reveals both messages
+	bool unique_iv;
+	bool available;
+};
+
+int probe_crypto_algorithms(void);
+// NULL for unknown algorithms and ones the kernel does not provide
+const struct crypto_algorithm_info* get_alg_info(int algorithm);
+
 struct crypto_db* create_crypto_db(uid_t uid);
-struct crypto_db* get_or_create_crypto_db(struct list_head *dbs, uid_t uid);
+void destroy_crypto_db(struct crypto_db *db);
+// NULL if the uid has no db yet
+struct crypto_db* find_crypto_db(struct cryptodev_t *dev, uid_t uid);
+struct crypto_db* get_or_create_crypto_db(struct cryptodev_t *dev, uid_t uid);
+// results queued on the fds of all uids
+void get_crypto_queue_totals(struct cryptodev_t *dev, __u64 *results,
+			     __u64 *bytes);
 
 int get_key_index(char *buf);
-bool is_valid_key(char *buf, int len);
-int add_key_to_db(struct crypto_db *db, int ix,
-		   char *buf, int len);
-int delete_key_from_db(struct crypto_db *db, int ix);
-
-int acquire_free_context_index(struct crypto_db *db);
-int acquire_context_index(struct crypto_db *db, int ix);
-void release_context_index(struct crypto_db *db, int ix);
+bool is_valid_key(int algorithm, char *buf, int len);
+// returns the new context id or an error
+int add_key_to_db(struct crypto_db *db, int algorithm, char *buf, int len);
+int delete_key_from_db(struct crypto_db *db, int id);
+
+/*
+ * Lookups return a referenced context, or NULL.  A context found this way
+ * may be deleted meanwhile; check is_active under its mutex.
+ */
+struct crypto_context* get_context(struct crypto_db *db, int id);
+// the first context with an id >= *id, which is updated
+struct crypto_context* get_next_context(struct crypto_db *db, int *id);
+void put_context(struct crypto_context *context);
+struct cryptiface_cipher* get_context_cipher(struct crypto_context *context,
+					     int algorithm);
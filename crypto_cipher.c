@@ -0,0 +1,211 @@
+/* -*- mode: C; fill-column: 80; c-file-style: "linux"; indent-tabs-mode: t  -*- */
+#include <linux/slab.h>
+#include <linux/err.h>
+#include <linux/kref.h>
+#include <linux/completion.h>
+#include <linux/crypto.h>
+#include <linux/scatterlist.h>
+#include <linux/percpu.h>
+
+#include "crypto_ioctlmagic.h"
+#include "crypto_algorithm.h"
+#include "crypto_cipher.h"
+#include "crypto_stats.h"
+#include "crypto_trace.h"
+
+struct cryptiface_cipher* create_cryptiface_cipher(int algorithm,
+						   const char *key,
+						   int key_len)
+{
+	const struct crypto_algorithm_info *info = get_alg_info(algorithm);
+	struct cryptiface_cipher *cipher;
+	int err;
+
+	if(NULL == info) {
+		return ERR_PTR(-EINVAL);
+	}
+	cipher = kmalloc(sizeof(*cipher), GFP_KERNEL);
+	if(NULL == cipher) {
+		return ERR_PTR(-ENOMEM);
+	}
+	cipher->stats = alloc_percpu(struct cryptiface_cipher_stats);
+	if(NULL == cipher->stats) {
+		err = -ENOMEM;
+		goto free_cipher;
+	}
+	cipher->tfm = crypto_alloc_ablkcipher(info->driver, 0, 0);
+	if(IS_ERR(cipher->tfm)) {
+		printk(KERN_DEBUG "alloc_ablkcipher %s failed\n",
+		       info->driver);
+		err = PTR_ERR(cipher->tfm);
+		goto free_stats;
+	}
+	if(crypto_ablkcipher_ivsize(cipher->tfm) > CRYPTO_MAX_IV_LENGTH
+	   || crypto_ablkcipher_blocksize(cipher->tfm) > PAGE_SIZE) {
+		printk(KERN_WARNING "%s has unsupported geometry\n",
+		       info->driver);
+		err = -EINVAL;
+		goto free_tfm;
+	}
+	err = crypto_ablkcipher_setkey(cipher->tfm, key, key_len);
+	if(err) {
+		printk(KERN_DEBUG "setkey() failed flags=%x\n",
+		       crypto_ablkcipher_get_flags(cipher->tfm));
+		goto free_tfm;
+	}
+	cipher->algorithm = algorithm;
+	cipher->context_id = -1;
+	kref_init(&cipher->ref);
+	return cipher;
+
+free_tfm:
+	crypto_free_ablkcipher(cipher->tfm);
+free_stats:
+	free_percpu(cipher->stats);
+free_cipher:
+	kfree(cipher);
+	return ERR_PTR(err);
+}
+
+static void release_cryptiface_cipher(struct kref *ref)
+{
+	struct cryptiface_cipher *cipher =
+		container_of(ref, struct cryptiface_cipher, ref);
+	free_percpu(cipher->stats);
+	crypto_free_ablkcipher(cipher->tfm);
+	kfree(cipher);
+}
+
+void get_cryptiface_cipher(struct cryptiface_cipher *cipher)
+{
+	kref_get(&cipher->ref);
+}
+
+void put_cryptiface_cipher(struct cryptiface_cipher *cipher)
+{
+	kref_put(&cipher->ref, release_cryptiface_cipher);
+}
+
+void get_cryptiface_cipher_stats(struct cryptiface_cipher *cipher,
+				 struct cryptiface_cipher_stats *sum)
+{
+	int cpu;
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		struct cryptiface_cipher_stats *stats =
+			per_cpu_ptr(cipher->stats, cpu);
+		sum->encrypt_ops += stats->encrypt_ops;
+		sum->encrypt_bytes += stats->encrypt_bytes;
+		sum->decrypt_ops += stats->decrypt_ops;
+		sum->decrypt_bytes += stats->decrypt_bytes;
+	}
+}
+
+struct ablkcipher_request* alloc_cipher_request(
+	struct cryptiface_cipher *cipher, crypto_completion_t complete,
+	void *data)
+{
+	struct ablkcipher_request *req;
+	req = ablkcipher_request_alloc(cipher->tfm, GFP_KERNEL);
+	if(NULL == req) {
+		return NULL;
+	}
+	ablkcipher_request_set_callback(req, CRYPTO_TFM_REQ_MAY_BACKLOG
+					| CRYPTO_TFM_REQ_MAY_SLEEP,
+					complete, data);
+	return req;
+}
+
+int submit_cipher_request(struct cryptiface_cipher *cipher,
+			  struct ablkcipher_request *req, bool encrypt)
+{
+	unsigned int nbytes = req->nbytes;
+	int err;
+	trace_cryptiface_cipher_start(cipher->context_id, cipher->algorithm,
+				      nbytes, encrypt);
+	if(encrypt) {
+		err = crypto_ablkcipher_encrypt(req);
+	} else {
+		err = crypto_ablkcipher_decrypt(req);
+	}
+	if(err == -EBUSY) {
+		// queued on the backlog, completion follows
+		err = -EINPROGRESS;
+	}
+	if(err != -EINPROGRESS) {
+		finish_cipher_request(cipher, req, err);
+	}
+	if(err == 0 || err == -EINPROGRESS) {
+		// a message split into pieces counts as one op, see
+		// count_cipher_op()
+		crypto_stats_count_bytes(cipher->algorithm, encrypt, nbytes);
+		if(encrypt) {
+			this_cpu_add(cipher->stats->encrypt_bytes, nbytes);
+		} else {
+			this_cpu_add(cipher->stats->decrypt_bytes, nbytes);
+		}
+	}
+	return err;
+}
+
+void finish_cipher_request(struct cryptiface_cipher *cipher,
+			   struct ablkcipher_request *req, int err)
+{
+	trace_cryptiface_cipher_finish(cipher->context_id, cipher->algorithm,
+				       req->nbytes, err);
+}
+
+void count_cipher_op(struct cryptiface_cipher *cipher, bool encrypt)
+{
+	crypto_stats_count_op(cipher->algorithm, encrypt);
+	if(encrypt) {
+		this_cpu_inc(cipher->stats->encrypt_ops);
+	} else {
+		this_cpu_inc(cipher->stats->decrypt_ops);
+	}
+}
+
+struct cipher_wait {
+	struct cryptiface_cipher *cipher;
+	struct completion completion;
+	int err;
+};
+
+static void cipher_wait_done(struct crypto_async_request *req, int err)
+{
+	struct cipher_wait *wait = req->data;
+	if(err == -EINPROGRESS) {
+		return;
+	}
+	finish_cipher_request(wait->cipher, ablkcipher_request_cast(req), err);
+	wait->err = err;
+	complete(&wait->completion);
+}
+
+int cipher_crypt_sync(struct cryptiface_cipher *cipher,
+		      struct scatterlist *src, struct scatterlist *dst,
+		      size_t len, void *iv, bool encrypt)
+{
+	struct ablkcipher_request *req;
+	struct cipher_wait wait;
+	u8 zero_iv[CRYPTO_MAX_IV_LENGTH] = {0};
+	int err;
+
+	if(NULL == iv) {
+		iv = zero_iv;
+	}
+	wait.cipher = cipher;
+	init_completion(&wait.completion);
+	req = alloc_cipher_request(cipher, cipher_wait_done, &wait);
+	if(NULL == req) {
+		return -ENOMEM;
+	}
+	ablkcipher_request_set_crypt(req, src, dst, len, iv);
+	err = submit_cipher_request(cipher, req, encrypt);
+	if(err == -EINPROGRESS) {
+		wait_for_completion(&wait.completion);
+		err = wait.err;
+	}
+	ablkcipher_request_free(req);
+	return err;
+}
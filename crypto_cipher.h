@@ -0,0 +1,68 @@
+/* -*- mode: C; fill-column: 80; c-file-style: "linux"; indent-tabs-mode: t  -*- */
+
+// #include <linux/crypto.h>
+// #include <linux/kref.h>
+
+// enough for the IV of every algorithm in the registry
+enum { CRYPTO_MAX_IV_LENGTH = 16 };
+
+struct cryptiface_cipher_stats {
+	unsigned long encrypt_ops;
+	unsigned long encrypt_bytes;
+	unsigned long decrypt_ops;
+	unsigned long decrypt_bytes;
+};
+
+/*
+ * A keyed transform shared by everything that encrypts with it.  In-flight
+ * requests hold a reference, so the tfm outlives whoever replaced it.
+ * References may only be dropped from process context.
+ */
+struct cryptiface_cipher {
+	struct crypto_ablkcipher *tfm;
+	int algorithm;
+	// of the context that caches it, for tracing; -1 if none
+	int context_id;
+	struct kref ref;
+	// bytes bumped on every submitted request, ops once per message;
+	// summed only when read
+	struct cryptiface_cipher_stats __percpu *stats;
+};
+
+struct cryptiface_cipher* create_cryptiface_cipher(int algorithm,
+						   const char *key,
+						   int key_len);
+void get_cryptiface_cipher(struct cryptiface_cipher *cipher);
+void put_cryptiface_cipher(struct cryptiface_cipher *cipher);
+void get_cryptiface_cipher_stats(struct cryptiface_cipher *cipher,
+				 struct cryptiface_cipher_stats *sum);
+
+/*
+ * complete() gets -EINPROGRESS when a backlogged request is started; it has
+ * to ignore that and wait for the final call.
+ */
+struct ablkcipher_request* alloc_cipher_request(
+	struct cryptiface_cipher *cipher, crypto_completion_t complete,
+	void *data);
+/*
+ * Returns 0 if the request finished synchronously (complete() will not be
+ * called), -EINPROGRESS if complete() will be called later, or an error.
+ */
+int submit_cipher_request(struct cryptiface_cipher *cipher,
+			  struct ablkcipher_request *req, bool encrypt);
+/*
+ * Traces the end of a request submit_cipher_request() returned
+ * -EINPROGRESS for; complete() calls it with the final err.  Any context.
+ */
+void finish_cipher_request(struct cryptiface_cipher *cipher,
+			   struct ablkcipher_request *req, int err);
+/*
+ * Counts one op for a message the user sees, however many requests it
+ * took: a result transformed without error, a batch entry or a ring
+ * entry.  Any context.
+ */
+void count_cipher_op(struct cryptiface_cipher *cipher, bool encrypt);
+// submits and sleeps until the request is done; NULL iv starts from zero
+int cipher_crypt_sync(struct cryptiface_cipher *cipher,
+		      struct scatterlist *src, struct scatterlist *dst,
+		      size_t len, void *iv, bool encrypt);
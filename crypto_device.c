@@ -6,15 +6,31 @@
 #include <linux/ioctl.h>
 #include <linux/slab.h>
 #include <linux/sched.h>
+#include <linux/kref.h>
+#include <linux/idr.h>
 #include <linux/crypto.h>
 #include <linux/scatterlist.h>
+#include <linux/mm.h>
+#include <linux/uio.h>
+#include <linux/pagemap.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/poll.h>
 #include <asm/uaccess.h>
 
 #include "crypto_structures.h"
 #include "crypto_algorithm.h"
 #include "crypto_ioctlmagic.h"
+#include "crypto_cipher.h"
+#include "crypto_pool.h"
+#include "crypto_ring.h"
+#include "crypto_parallel.h"
+#include "crypto_stats.h"
 #include "crypto_device.h"
 
+#define CREATE_TRACE_POINTS
+#include "crypto_trace.h"
+
 struct cryptodev_t cryptodev;
 
 struct cryptodev_t* get_cryptodev(void) {
@@ -25,134 +41,212 @@ static const unsigned int cryptodev_minor = 0;
 
 static struct class *crypto_class;
 
+static struct kmem_cache *result_cache;
+
+static unsigned int pin_threshold = 256 << 10;
+module_param(pin_threshold, uint, 0644);
+MODULE_PARM_DESC(pin_threshold,
+		 "Smallest buffer encrypted from pinned user pages when an fd "
+		 "asks for it");
+
+/*
+ * Results waiting to be read pin their pages.  Writers wait for readers
+ * once an fd, or all fds of a uid together, hold this much; 0 is no limit.
+ * A result alone on its queue is let through whatever its size.
+ */
+static unsigned long queue_max_bytes = 64 << 20;
+module_param(queue_max_bytes, ulong, 0644);
+MODULE_PARM_DESC(queue_max_bytes, "Bytes of results queued per fd");
+
+static unsigned int queue_max_results = 1024;
+module_param(queue_max_results, uint, 0644);
+MODULE_PARM_DESC(queue_max_results, "Results queued per fd");
+
+static unsigned long uid_queue_max_bytes = 256 << 20;
+module_param(uid_queue_max_bytes, ulong, 0644);
+MODULE_PARM_DESC(uid_queue_max_bytes, "Bytes of results queued per uid");
+
+static unsigned int uid_queue_max_results = 8192;
+module_param(uid_queue_max_results, uint, 0644);
+MODULE_PARM_DESC(uid_queue_max_results, "Results queued per uid");
+
+struct cryptiface_status;
+
+/*
+ * A result is queued as soon as its write is admitted, so the queue keeps
+ * submission order; readers only take it once the cipher marks it done.
+ */
 struct cryptiface_result {
 	struct scatterlist *sg;
 	size_t sg_len;
+	// leading pages spliced into a pipe, which owns them now
+	size_t sg_given;
 	size_t data_len;
+	// bytes already read, advanced under the queue lock
+	size_t offset;
+	u8 iv[CRYPTO_MAX_IV_LENGTH];
+
+	struct cryptiface_status *status;
+	struct cryptiface_cipher *cipher;
+	bool encrypt;
+	struct ablkcipher_request *req;
+	bool done;
+	int err;
+	// written with CRYPTIFACE_F_TAGGED, read behind a header
+	bool tagged;
+	u64 cookie;
 
 	struct list_head result_list;
+	// on ready_queue once done
+	struct list_head ready_list;
 };
 
 struct cryptiface_status {
 	struct crypto_db *db;
-	struct crypto_blkcipher *tfm;
+	// replaced only under write_mutex
+	struct cryptiface_cipher *cipher;
 	bool encrypt;
 
+	// held by writers only while they take their place in the queue
 	struct mutex write_mutex;
+	// CRYPTIFACE_F_*, changed under write_mutex and the queue lock
+	unsigned int flags;
+	// IV of the next plain write, under write_mutex
+	bool has_write_iv;
+	u8 write_iv[CRYPTO_MAX_IV_LENGTH];
+
+	// Stream session, under write_mutex: the IV carries over from one
+	// write to the next and a trailing partial block waits for more.
+	bool streaming;
+	u8 stream_iv[CRYPTO_MAX_IV_LENGTH];
+	u8 stream_tail[CRYPTO_MAX_IV_LENGTH];
+	size_t stream_tail_len;
 
 	wait_queue_head_t new_result_waitqueue;
-	struct mutex results_queue_mutex;
+	// taken from cipher completion callbacks, which may run in interrupt
+	// context
+	spinlock_t results_queue_lock;
 
 	struct list_head results_queue;
+	// done results in the order they completed
+	struct list_head ready_queue;
+	// results queued and bytes in them left to read, kept with the queue
+	int results_count;
+	size_t results_bytes;
+	// Serializes readers, so the head of the queue stays put while one
+	// copies out of it.
+	struct mutex read_mutex;
 	bool has_data_ready;
-};
+	int inflight;
+	wait_queue_head_t inflight_waitqueue;
 
-static const char* get_alg_name(enum crypto_algorithms alg)
-{
-	switch(alg) {
-	case CRYPTIFACE_ALG_DES:
-		return "ecb(des)";
-	default:
-		return NULL;
-	}
-}
+	// queued results not read yet, under db->queue_space_lock
+	size_t queued_bytes;
+	unsigned int queued_results;
 
-static int cryptiface_ioctl_setcurrent(struct cryptiface_status *status,
-				       int algorithm, int context_id,
-				       int encrypt)
+	// set up at most once per fd, never torn down before release
+	struct mutex ring_mutex;
+	struct cryptiface_ring *ring;
+};
+
+static struct cryptiface_cipher* lookup_cipher(struct crypto_db *db,
+					      int algorithm, int context_id)
 {
 	struct crypto_context *context;
-	struct crypto_blkcipher *tfm;
-	int err;
-	if(algorithm < 0 || algorithm >= CRYPTIFACE_ALG_INVALID) {
-		printk(KERN_DEBUG "setcurrent with invalid algorithm: %d\n",
-		       algorithm);
-		return -EINVAL;
+	struct cryptiface_cipher *cipher;
+	if(NULL == get_alg_info(algorithm)) {
+		printk(KERN_DEBUG "invalid algorithm: %d\n", algorithm);
+		return ERR_PTR(-EINVAL);
 	}
 	if(context_id < 0 || context_id >= CRYPTO_MAX_CONTEXT_COUNT) {
-		printk(KERN_DEBUG "setcurrent with invalid context id: %d\n",
-		       context_id);
-		return -EINVAL;
+		printk(KERN_DEBUG "invalid context id: %d\n", context_id);
+		return ERR_PTR(-EINVAL);
 	}
 
-	tfm = crypto_alloc_blkcipher(get_alg_name(algorithm), 0, 0);
-	if(IS_ERR(tfm)) {
-		printk(KERN_DEBUG "alloc_blkcipher %s failed\n",
-		       get_alg_name(algorithm));
-		return PTR_ERR(tfm);
+	context = get_context(db, context_id);
+	if(NULL == context) {
+		printk(KERN_DEBUG "trying to use invalid context: %d\n",
+		       context_id);
+		return ERR_PTR(-EINVAL);
 	}
-
-	context = &status->db->contexts[context_id];
 	if(mutex_lock_interruptible(&context->context_mutex)) {
-		err = -ERESTARTSYS;
-		goto fail;
+		cipher = ERR_PTR(-ERESTARTSYS);
+		goto put;
 	}
 	if(!context->is_active) {
-		printk(KERN_DEBUG "trying to setcurrent invalid context: %d\n",
-		       context_id);
-		err = -EINVAL;
-		goto unlock;
+		// deleted since we looked it up
+		cipher = ERR_PTR(-EINVAL);
+	} else {
+		cipher = get_context_cipher(context, algorithm);
 	}
-	err = crypto_blkcipher_setkey(tfm, context->key, context->key_len);
 	mutex_unlock(&context->context_mutex);
-	if (err) {
-		printk(KERN_DEBUG "setkey() failed flags=%x\n",
-		       crypto_blkcipher_get_flags(tfm));
-		goto fail;
+put:
+	put_context(context);
+	return cipher;
+}
+
+static int end_stream(struct cryptiface_status *status, bool nonblock);
+static void update_data_ready(struct cryptiface_status *status);
+
+static int cryptiface_ioctl_setcurrent(struct cryptiface_status *status,
+				       int algorithm, int context_id,
+				       int encrypt, bool nonblock)
+{
+	struct cryptiface_cipher *cipher, *old_cipher;
+	int err;
+
+	cipher = lookup_cipher(status->db, algorithm, context_id);
+	if(IS_ERR(cipher)) {
+		return PTR_ERR(cipher);
 	}
 
-	if(status->tfm != NULL) {
-		crypto_free_blkcipher(status->tfm);
+	if(mutex_lock_interruptible(&status->write_mutex)) {
+		put_cryptiface_cipher(cipher);
+		return -ERESTARTSYS;
 	}
-	status->tfm = tfm;
+	// a stream belongs to the key it was started with
+	if((err = end_stream(status, nonblock))) {
+		mutex_unlock(&status->write_mutex);
+		put_cryptiface_cipher(cipher);
+		return err;
+	}
+	old_cipher = status->cipher;
+	status->cipher = cipher;
 	status->encrypt = encrypt;
+	// an IV set for the old key is not one for the new
+	status->has_write_iv = false;
+	mutex_unlock(&status->write_mutex);
+	if(NULL != old_cipher) {
+		// requests still in flight hold their own references
+		put_cryptiface_cipher(old_cipher);
+	}
 	return 0;
-unlock:
-	mutex_unlock(&context->context_mutex);
-fail:
-	crypto_free_blkcipher(tfm);
-	return err;
 }
 
 static int cryptiface_ioctl_addkey(int algorithm, char *key, size_t size)
 {
 	struct crypto_db *db;
-	int result = 0, ix;
+	int result = 0;
 
-	if(algorithm < 0 || algorithm >= CRYPTIFACE_ALG_INVALID) {
+	if(NULL == get_alg_info(algorithm)) {
 		printk(KERN_DEBUG "addkey with invalid algorithm: %d\n",
 		       algorithm);
 		result = -EINVAL;
 		goto out;
 	}
-	if(!is_valid_key(key, size)) {
+	if(!is_valid_key(algorithm, key, size)) {
 		printk(KERN_WARNING "invalid key\n");
 		result = -EINVAL;
 		goto out;
 	}
 
-	if(mutex_lock_interruptible(&get_cryptodev()->crypto_dbs_mutex)) {
-		return -ERESTARTSYS;
-	}
-	db = get_or_create_crypto_db(&get_cryptodev()->crypto_dbs,
-				     current_euid());
-	mutex_unlock(&get_cryptodev()->crypto_dbs_mutex);
+	db = get_or_create_crypto_db(get_cryptodev(), current_euid());
 	if(NULL == db) {
 		result = -ENOMEM;
 		goto out;
 	}
 
-	ix = acquire_free_context_index(db);
-	if(ix < 0) {
-		result = ix;
-		goto out;
-	} else {
-		result = add_key_to_db(db, ix, key, size);
-		if(result >= 0) {
-			result = ix;
-		}
-		release_context_index(db, ix);
-	}
+	result = add_key_to_db(db, algorithm, key, size);
 
 out:
 	return result;
@@ -162,7 +256,7 @@ static int cryptiface_ioctl_delkey(int algorithm, int id)
 {
 	int result = 0;
 	struct crypto_db *db;
-	if(algorithm < 0 || algorithm >= CRYPTIFACE_ALG_INVALID) {
+	if(NULL == get_alg_info(algorithm)) {
 		printk(KERN_DEBUG "delkey with invalid algorithm: %d\n",
 		       algorithm);
 		result = -EINVAL;
@@ -170,296 +264,1885 @@ static int cryptiface_ioctl_delkey(int algorithm, int id)
 	}
 	if(id < 0 || id >= CRYPTO_MAX_CONTEXT_COUNT) {
 		printk(KERN_DEBUG "invalid context id");
+		result = -EINVAL;
+		goto out;
 	}
 
-	if(mutex_lock_interruptible(&get_cryptodev()->crypto_dbs_mutex)) {
-		return -ERESTARTSYS;
-	}
-	db = get_or_create_crypto_db(&get_cryptodev()->crypto_dbs,
-				     current_euid());
-	mutex_unlock(&get_cryptodev()->crypto_dbs_mutex);
+	db = get_or_create_crypto_db(get_cryptodev(), current_euid());
 	if(NULL == db) {
 		result = -ENOMEM;
 		goto out;
 	}
 
-	if(acquire_context_index(db, id)) {
-		return -ERESTARTSYS;
-	}
 	result = delete_key_from_db(db, id);
-	release_context_index(db, id);
 
 out:
 	return result;
 }
 
+static void free_data_pages(struct scatterlist *sg, int nents)
+{
+	int i;
+	for(i = 0; i<nents; i++) {
+		free_pool_page(sg_virt(&sg[i]));
+	}
+}
+
+static void free_data_sg(struct scatterlist *sg, int nents)
+{
+	free_data_pages(sg, nents);
+	free_sg_table(sg, nents);
+}
+
+// fills the entries of sg with enough whole pool pages to hold len bytes
+static int alloc_data_pages(struct cryptiface_cipher *cipher,
+			    struct scatterlist *sg, size_t len)
+{
+	int i, count = DIV_ROUND_UP(len, PAGE_SIZE);
+
+	for(i = 0; i<count; i++) {
+		void *page = alloc_pool_page(GFP_KERNEL);
+		if(NULL == page) {
+			free_data_pages(sg, i);
+			return -ENOMEM;
+		}
+		sg_set_buf(&sg[i], page, PAGE_SIZE);
+	}
+	trace_cryptiface_alloc_pages(cipher->context_id, cipher->algorithm, len,
+				     count);
+	return 0;
+}
+
+// sg table over enough whole pool pages to hold len bytes for cipher
+static struct scatterlist* alloc_data_sg(struct cryptiface_cipher *cipher,
+					 size_t len, int *nents)
+{
+	struct scatterlist *sg;
+	int count = DIV_ROUND_UP(len, PAGE_SIZE);
+
+	sg = alloc_sg_table(count, GFP_KERNEL);
+	if(NULL == sg) {
+		return NULL;
+	}
+	if(alloc_data_pages(cipher, sg, len)) {
+		free_sg_table(sg, count);
+		return NULL;
+	}
+	*nents = count;
+	return sg;
+}
+
+struct iovec_cursor {
+	const struct iovec *iov;
+	unsigned long nr_segs;
+	size_t offset;
+};
+
+static void init_iovec_cursor(struct iovec_cursor *cursor,
+			      const struct iovec *iov, unsigned long nr_segs)
+{
+	cursor->iov = iov;
+	cursor->nr_segs = nr_segs;
+	cursor->offset = 0;
+}
+
+static int copy_from_iovec(void *dst, struct iovec_cursor *cursor,
+			   size_t len)
+{
+	while(len > 0) {
+		size_t n;
+		if(cursor->nr_segs == 0) {
+			return -EFAULT;
+		}
+		n = min(len, cursor->iov->iov_len - cursor->offset);
+		if(copy_from_user(dst, cursor->iov->iov_base + cursor->offset,
+				  n)) {
+			return -EFAULT;
+		}
+		dst += n;
+		len -= n;
+		cursor->offset += n;
+		if(cursor->offset == cursor->iov->iov_len) {
+			cursor->iov++;
+			cursor->nr_segs--;
+			cursor->offset = 0;
+		}
+	}
+	return 0;
+}
+
+static int copy_to_iovec(struct iovec_cursor *cursor, const void *src,
+			 size_t len)
+{
+	while(len > 0) {
+		size_t n;
+		if(cursor->nr_segs == 0) {
+			return -EFAULT;
+		}
+		n = min(len, cursor->iov->iov_len - cursor->offset);
+		if(copy_to_user(cursor->iov->iov_base + cursor->offset, src,
+				n)) {
+			return -EFAULT;
+		}
+		src += n;
+		len -= n;
+		cursor->offset += n;
+		if(cursor->offset == cursor->iov->iov_len) {
+			cursor->iov++;
+			cursor->nr_segs--;
+			cursor->offset = 0;
+		}
+	}
+	return 0;
+}
+
+// fills the pages from offset on with count bytes from the cursor and
+// zeroes the rest
+static int copy_user_to_sg(struct scatterlist *sg, int nents, size_t offset,
+			   struct iovec_cursor *cursor, size_t count)
+{
+	int i = offset >> PAGE_SHIFT;
+	size_t in_page = offset_in_page(offset);
+	for(; i<nents; i++) {
+		char *page = sg_virt(&sg[i]) + in_page;
+		size_t room = PAGE_SIZE - in_page;
+		size_t to_copy = min(count, room);
+		if(copy_from_iovec(page, cursor, to_copy)) {
+			return -EFAULT;
+		}
+		if(to_copy < room) {
+			// zero fill
+			memset(page+to_copy, 0, room-to_copy);
+		}
+		count -= to_copy;
+		in_page = 0;
+	}
+	return 0;
+}
+
+static int copy_sg_to_user(struct iovec_cursor *cursor,
+			   struct scatterlist *sg, size_t offset, size_t count)
+{
+	int i = offset >> PAGE_SHIFT;
+	size_t in_page = offset_in_page(offset);
+	for(; count > 0; i++) {
+		size_t to_copy = min(count, (size_t) (PAGE_SIZE - in_page));
+		if(copy_to_iovec(cursor, sg_virt(&sg[i]) + in_page, to_copy)) {
+			return -EFAULT;
+		}
+		count -= to_copy;
+		in_page = 0;
+	}
+	return 0;
+}
+
+struct pinned_buf {
+	struct page **pages;
+	int nr_pages;
+	struct scatterlist *sg;
+	int nents;
+	char *bounce;
+};
+
+/*
+ * Pins pin_len bytes at buf and builds an sg table over them.  If tail_size
+ * is non-zero, the tail_len bytes that follow are copied into a zeroed
+ * bounce buffer of tail_size bytes appended to the table; this is how a
+ * source that is not a multiple of the block size gets padded.
+ */
+static int pin_user_buf(struct pinned_buf *pb, const char __user *buf,
+			size_t pin_len, size_t tail_len, size_t tail_size,
+			int write)
+{
+	unsigned long addr = (unsigned long) buf;
+	size_t offset, remaining;
+	int i, pinned = 0, err;
+
+	pb->nr_pages = 0;
+	if(pin_len > 0) {
+		pb->nr_pages = ((addr + pin_len - 1) >> PAGE_SHIFT)
+			- (addr >> PAGE_SHIFT) + 1;
+	}
+	pb->nents = pb->nr_pages + (tail_size > 0 ? 1 : 0);
+	pb->pages = NULL;
+	pb->sg = NULL;
+	pb->bounce = NULL;
+
+	if(pb->nr_pages > 0) {
+		pb->pages = kmalloc(pb->nr_pages*sizeof(*pb->pages),
+				    GFP_KERNEL);
+		if(NULL == pb->pages) {
+			return -ENOMEM;
+		}
+		pinned = get_user_pages_fast(addr, pb->nr_pages, write,
+					     pb->pages);
+		if(pinned < pb->nr_pages) {
+			err = -EFAULT;
+			goto unpin;
+		}
+	}
+	pb->sg = alloc_sg_table(pb->nents, GFP_KERNEL);
+	if(NULL == pb->sg) {
+		err = -ENOMEM;
+		goto unpin;
+	}
+	offset = offset_in_page(addr);
+	remaining = pin_len;
+	for(i = 0; i<pb->nr_pages; i++) {
+		size_t n = min(remaining, (size_t) (PAGE_SIZE - offset));
+		sg_set_page(&pb->sg[i], pb->pages[i], n, offset);
+		offset = 0;
+		remaining -= n;
+	}
+	if(tail_size > 0) {
+		pb->bounce = kzalloc(tail_size, GFP_KERNEL);
+		if(NULL == pb->bounce) {
+			err = -ENOMEM;
+			goto free_sg;
+		}
+		if(copy_from_user(pb->bounce, buf + pin_len, tail_len)) {
+			err = -EFAULT;
+			goto free_bounce;
+		}
+		sg_set_buf(&pb->sg[pb->nr_pages], pb->bounce, tail_size);
+	}
+	return 0;
+
+free_bounce:
+	kfree(pb->bounce);
+free_sg:
+	free_sg_table(pb->sg, pb->nents);
+unpin:
+	for(i = 0; i<pinned; i++) {
+		put_page(pb->pages[i]);
+	}
+	kfree(pb->pages);
+	return err;
+}
+
+static void unpin_user_buf(struct pinned_buf *pb, bool dirty)
+{
+	int i;
+	for(i = 0; i<pb->nr_pages; i++) {
+		if(dirty) {
+			set_page_dirty_lock(pb->pages[i]);
+		}
+		put_page(pb->pages[i]);
+	}
+	kfree(pb->pages);
+	free_sg_table(pb->sg, pb->nents);
+	kfree(pb->bounce);
+}
+
+// encrypts between pinned user buffers, without copying through the kernel
+static long cryptiface_batch_entry_pinned(struct cryptiface_cipher *cipher,
+					  bool encrypt, const char __user *in,
+					  char __user *out, size_t len,
+					  size_t padded, u8 *iv)
+{
+	unsigned int block_size = crypto_ablkcipher_blocksize(cipher->tfm);
+	size_t aligned = rounddown(len, block_size);
+	struct pinned_buf src, dst;
+	int err;
+
+	if(in == out) {
+		// in place, padding goes into the user buffer
+		if(padded > len && clear_user(out + len, padded - len)) {
+			return -EFAULT;
+		}
+		if((err = pin_user_buf(&dst, out, padded, 0, 0, 1))) {
+			return err;
+		}
+		err = cipher_crypt_sync(cipher, dst.sg, dst.sg, padded, iv,
+					encrypt);
+		unpin_user_buf(&dst, true);
+		return err ? err : padded;
+	}
+
+	if((err = pin_user_buf(&src, in, aligned, len - aligned,
+			       padded - aligned, 0))) {
+		return err;
+	}
+	if(!(err = pin_user_buf(&dst, out, padded, 0, 0, 1))) {
+		err = cipher_crypt_sync(cipher, src.sg, dst.sg, padded, iv,
+					encrypt);
+		unpin_user_buf(&dst, true);
+	}
+	unpin_user_buf(&src, false);
+	return err ? err : padded;
+}
+
+static long cryptiface_batch_entry(struct cryptiface_cipher *cipher,
+				   bool encrypt, bool pin,
+				   const char __user *in,
+				   char __user *out, size_t len, u8 *iv)
+{
+	struct iovec in_iov = { .iov_base = (void __user *) in,
+				.iov_len = len };
+	struct iovec_cursor cursor;
+	struct scatterlist *sg;
+	size_t padded;
+	int nents, err;
+
+	if(len == 0) {
+		return 0;
+	}
+	if(len > CRYPTIFACE_MAX_BATCH_LEN) {
+		return -E2BIG;
+	}
+	padded = roundup(len, crypto_ablkcipher_blocksize(cipher->tfm));
+	if(pin && len >= pin_threshold) {
+		return cryptiface_batch_entry_pinned(cipher, encrypt, in, out,
+						     len, padded, iv);
+	}
+	sg = alloc_data_sg(cipher, padded, &nents);
+	if(NULL == sg) {
+		return -ENOMEM;
+	}
+	init_iovec_cursor(&cursor, &in_iov, 1);
+	err = copy_user_to_sg(sg, nents, 0, &cursor, len);
+	if(!err) {
+		err = cipher_crypt_sync(cipher, sg, sg, padded, iv, encrypt);
+	}
+	if(!err) {
+		struct iovec out_iov = { .iov_base = out, .iov_len = padded };
+		init_iovec_cursor(&cursor, &out_iov, 1);
+		err = copy_sg_to_user(&cursor, sg, 0, padded);
+	}
+	free_data_sg(sg, nents);
+	return err ? err : padded;
+}
+
+/*
+ * Every entry names its own key, direction and IV; the output buffer has
+ * to hold len rounded up to the cipher block size.  Per-entry outcomes go to
+ * entry.result, the return value is the number of entries processed.
+ */
+static int cryptiface_ioctl_batch(struct cryptiface_status *status,
+		int algorithm, struct __cryptiface_batch_entry __user *entries,
+		int count)
+{
+	struct __cryptiface_batch_entry entry;
+	struct cryptiface_cipher *cipher = NULL;
+	bool pin = ACCESS_ONCE(status->flags) & CRYPTIFACE_F_PIN_USER;
+	int context_id = -1;
+	int i, err = 0;
+
+	if(count < 0 || count > CRYPTIFACE_MAX_BATCH) {
+		printk(KERN_DEBUG "invalid batch size: %d\n", count);
+		return -EINVAL;
+	}
+	for(i = 0; i<count; i++) {
+		long result;
+		if(signal_pending(current)) {
+			err = -ERESTARTSYS;
+			break;
+		}
+		if(copy_from_user(&entry, &entries[i], sizeof(entry))) {
+			err = -EFAULT;
+			break;
+		}
+		// consecutive records usually share a key
+		if(NULL == cipher || entry.context_id != context_id) {
+			if(NULL != cipher) {
+				put_cryptiface_cipher(cipher);
+			}
+			cipher = lookup_cipher(status->db, algorithm,
+					       entry.context_id);
+			if(IS_ERR(cipher)) {
+				result = PTR_ERR(cipher);
+				cipher = NULL;
+				goto put_result;
+			}
+			context_id = entry.context_id;
+		}
+		result = cryptiface_batch_entry(cipher, entry.encrypt, pin,
+						entry.in, entry.out,
+						entry.len, entry.iv);
+		if(result > 0) {
+			count_cipher_op(cipher, entry.encrypt);
+		}
+	put_result:
+		if(put_user(result, &entries[i].result)) {
+			err = -EFAULT;
+			break;
+		}
+	}
+	if(NULL != cipher) {
+		put_cryptiface_cipher(cipher);
+	}
+	return i > 0 ? i : err;
+}
+
 static int cryptiface_ioctl_numresults(struct cryptiface_status *status)
 {
-	struct list_head *head;
-	int count = 0;
-	if(mutex_lock_interruptible(&status->results_queue_mutex)) {
-		return -ERESTARTSYS;
+	int count;
+	spin_lock_irq(&status->results_queue_lock);
+	count = status->results_count;
+	spin_unlock_irq(&status->results_queue_lock);
+	return count;
+}
+
+static void cryptiface_ioctl_resultstat(struct cryptiface_status *status,
+					struct __cryptiface_resultstat_op *stat)
+{
+	struct cryptiface_result *head;
+
+	spin_lock_irq(&status->results_queue_lock);
+	stat->count = status->results_count;
+	stat->bytes = status->results_bytes;
+	stat->head_size = 0;
+	if(!list_empty(&status->results_queue)) {
+		head = list_first_entry(&status->results_queue,
+					struct cryptiface_result,
+					result_list);
+		stat->head_size = head->data_len - head->offset;
+	}
+	spin_unlock_irq(&status->results_queue_lock);
+}
+
+static int cryptiface_ioctl_sizeresults(struct cryptiface_status *status,
+					size_t __user *results,
+					int count)
+{
+	int err;
+	int i, queued;
+	size_t *sizes;
+	struct cryptiface_result *result;
+	struct list_head *head;
+
+	queued = cryptiface_ioctl_numresults(status);
+	count = min(count, queued);
+	if(count <= 0) {
+		return 0;
+	}
+	// the queue lock is a spinlock, so sizes are copied out afterwards
+	sizes = kmalloc(count*sizeof(*sizes), GFP_KERNEL);
+	if(NULL == sizes) {
+		return -ENOMEM;
+	}
+	i = 0;
+	spin_lock_irq(&status->results_queue_lock);
+	list_for_each(head, &status->results_queue) {
+		if(i >= count) {
+			break;
+		}
+		result = list_entry(head, struct cryptiface_result,
+				    result_list);
+		sizes[i] = result->data_len - result->offset;
+		i++;
+	}
+	spin_unlock_irq(&status->results_queue_lock);
+	err = i;
+	if(copy_to_user(results, sizes, i*sizeof(*sizes))) {
+		err = -EFAULT;
+	}
+	kfree(sizes);
+	return err;
+}
+
+static int cryptiface_ioctl_ring_setup(struct cryptiface_status *status,
+				       unsigned int entries, size_t data_size,
+				       size_t *mmap_size)
+{
+	struct cryptiface_ring *ring;
+	int err = 0;
+
+	if(mutex_lock_interruptible(&status->ring_mutex)) {
+		return -ERESTARTSYS;
+	}
+	if(NULL != status->ring) {
+		printk(KERN_DEBUG "ring already set up\n");
+		err = -EBUSY;
+		goto unlock;
+	}
+	ring = create_crypto_ring(entries, data_size);
+	if(IS_ERR(ring)) {
+		err = PTR_ERR(ring);
+		goto unlock;
+	}
+	*mmap_size = crypto_ring_mmap_size(ring);
+	status->ring = ring;
+unlock:
+	mutex_unlock(&status->ring_mutex);
+	return err;
+}
+
+static int cryptiface_ioctl_ring_enter(struct cryptiface_status *status)
+{
+	struct cryptiface_ring *ring;
+	struct cryptiface_cipher *cipher;
+	bool encrypt;
+	int err;
+
+	if(mutex_lock_interruptible(&status->ring_mutex)) {
+		return -ERESTARTSYS;
+	}
+	ring = status->ring;
+	mutex_unlock(&status->ring_mutex);
+	if(NULL == ring) {
+		printk(KERN_DEBUG "entering ring that is not set up\n");
+		return -EINVAL;
+	}
+
+	if(mutex_lock_interruptible(&status->write_mutex)) {
+		return -ERESTARTSYS;
+	}
+	cipher = status->cipher;
+	encrypt = status->encrypt;
+	if(NULL != cipher) {
+		get_cryptiface_cipher(cipher);
+	}
+	mutex_unlock(&status->write_mutex);
+	if(NULL == cipher) {
+		printk(KERN_DEBUG "entering ring without setting key\n");
+		return -EINVAL;
+	}
+	err = crypto_ring_enter(ring, cipher, encrypt);
+	put_cryptiface_cipher(cipher);
+	return err;
+}
+
+static int cryptiface_ioctl_setflags(struct cryptiface_status *status,
+				     unsigned int flags)
+{
+	if(flags & ~CRYPTIFACE_F_ALL) {
+		printk(KERN_DEBUG "setflags with unknown flags: %x\n", flags);
+		return -EINVAL;
+	}
+	if(mutex_lock_interruptible(&status->write_mutex)) {
+		return -ERESTARTSYS;
+	}
+	spin_lock_irq(&status->results_queue_lock);
+	status->flags = flags;
+	// CRYPTIFACE_F_TAGGED changes which result is next
+	update_data_ready(status);
+	if(status->has_data_ready) {
+		wake_up_interruptible(&status->new_result_waitqueue);
+	}
+	spin_unlock_irq(&status->results_queue_lock);
+	mutex_unlock(&status->write_mutex);
+	return 0;
+}
+
+static int cryptiface_ioctl_setiv(struct cryptiface_status *status,
+				  const u8 __user *iv, size_t iv_len)
+{
+	u8 new_iv[CRYPTO_MAX_IV_LENGTH];
+	int err = 0;
+
+	if(iv_len > sizeof(new_iv)) {
+		printk(KERN_DEBUG "IV too long: %zu\n", iv_len);
+		return -EINVAL;
+	}
+	if(copy_from_user(new_iv, iv, iv_len)) {
+		return -EFAULT;
+	}
+	if(mutex_lock_interruptible(&status->write_mutex)) {
+		return -ERESTARTSYS;
+	}
+	if(NULL == status->cipher) {
+		printk(KERN_DEBUG "setiv on cryptiface without setting key\n");
+		err = -EINVAL;
+	} else if(status->streaming) {
+		// the stream carries its own
+		printk(KERN_DEBUG "setiv on a stream\n");
+		err = -EINVAL;
+	} else if(iv_len != crypto_ablkcipher_ivsize(status->cipher->tfm)) {
+		printk(KERN_DEBUG "IV of wrong length: %zu\n", iv_len);
+		err = -EINVAL;
+	} else {
+		memcpy(status->write_iv, new_iv, iv_len);
+		status->has_write_iv = true;
+	}
+	mutex_unlock(&status->write_mutex);
+	return err;
+}
+
+static int cryptiface_open(struct inode *inode, struct file *file)
+{
+	struct crypto_db *db;
+	struct cryptiface_status *status = kmalloc(sizeof(*status), GFP_KERNEL);
+	int err;
+	if(NULL == status) {
+		return -ENOMEM;
+	}
+	db = get_or_create_crypto_db(get_cryptodev(), current_euid());
+	if(NULL == db) {
+		err = -ENOMEM;
+		goto fail;
+	}
+	status->cipher = NULL;
+	status->flags = 0;
+	status->has_write_iv = false;
+	status->streaming = false;
+	status->db = db;
+	status->has_data_ready = false;
+	status->inflight = 0;
+	status->results_count = 0;
+	status->results_bytes = 0;
+	status->queued_bytes = 0;
+	status->queued_results = 0;
+	mutex_init(&status->write_mutex);
+	mutex_init(&status->read_mutex);
+	init_waitqueue_head(&status->new_result_waitqueue);
+	init_waitqueue_head(&status->inflight_waitqueue);
+	spin_lock_init(&status->results_queue_lock);
+	INIT_LIST_HEAD(&status->results_queue);
+	INIT_LIST_HEAD(&status->ready_queue);
+	mutex_init(&status->ring_mutex);
+	status->ring = NULL;
+	file->private_data = status;
+	return 0;
+fail:
+	kfree(status);
+	return err;
+}
+
+// everything but the data pages
+static void free_result_entry(struct cryptiface_result *result)
+{
+	free_sg_table(result->sg, result->sg_len);
+	ablkcipher_request_free(result->req);
+	if(NULL != result->cipher) {
+		put_cryptiface_cipher(result->cipher);
+	}
+	kmem_cache_free(result_cache, result);
+}
+
+static void free_cryptiface_result(struct cryptiface_result *result)
+{
+	free_data_pages(result->sg + result->sg_given,
+			result->sg_len - result->sg_given);
+	free_result_entry(result);
+}
+
+static bool fits_queue_limits(size_t queued_bytes, unsigned int queued_results,
+			      size_t bytes, unsigned long max_bytes,
+			      unsigned int max_results)
+{
+	if(queued_results == 0) {
+		return true;
+	}
+	return (max_bytes == 0 || queued_bytes + bytes <= max_bytes)
+		&& (max_results == 0 || queued_results < max_results);
+}
+
+// Called with db->queue_space_lock held.
+static bool queue_space_fits(struct cryptiface_status *status, size_t bytes)
+{
+	struct crypto_db *db = status->db;
+	return fits_queue_limits(status->queued_bytes, status->queued_results,
+				 bytes, queue_max_bytes, queue_max_results)
+		&& fits_queue_limits(db->queued_bytes, db->queued_results,
+				     bytes, uid_queue_max_bytes,
+				     uid_queue_max_results);
+}
+
+static bool try_reserve_queue_space(struct cryptiface_status *status,
+				    size_t bytes)
+{
+	struct crypto_db *db = status->db;
+	bool fits;
+
+	spin_lock(&db->queue_space_lock);
+	fits = queue_space_fits(status, bytes);
+	if(fits) {
+		status->queued_bytes += bytes;
+		status->queued_results++;
+		db->queued_bytes += bytes;
+		db->queued_results++;
+	}
+	spin_unlock(&db->queue_space_lock);
+	return fits;
+}
+
+// Accounts one result of bytes before it is queued, waiting for readers
+// to make room.
+static int reserve_queue_space(struct cryptiface_status *status,
+			       size_t bytes, bool nonblock)
+{
+	if(try_reserve_queue_space(status, bytes)) {
+		return 0;
+	}
+	if(nonblock) {
+		return -EAGAIN;
+	}
+	crypto_stats_count_event(CRYPTO_STAT_QUEUE_SPACE_WAIT);
+	if(wait_event_interruptible(status->db->queue_space_waitqueue,
+				    try_reserve_queue_space(status, bytes))) {
+		return -ERESTARTSYS;
+	}
+	return 0;
+}
+
+// once a result is read, or was never queued
+static void release_queue_space(struct cryptiface_status *status,
+				size_t bytes)
+{
+	struct crypto_db *db = status->db;
+
+	spin_lock(&db->queue_space_lock);
+	status->queued_bytes -= bytes;
+	status->queued_results--;
+	db->queued_bytes -= bytes;
+	db->queued_results--;
+	spin_unlock(&db->queue_space_lock);
+	// writers of every fd of the uid may be waiting
+	wake_up_interruptible(&db->queue_space_waitqueue);
+}
+
+// mutex_lock_interruptible() that counts the times it had to wait
+static int lock_counted(struct mutex *lock, enum crypto_stat_event event)
+{
+	if(mutex_trylock(lock)) {
+		return 0;
+	}
+	crypto_stats_count_event(event);
+	return mutex_lock_interruptible(lock);
+}
+
+static bool cryptiface_idle(struct cryptiface_status *status)
+{
+	bool idle;
+	spin_lock_irq(&status->results_queue_lock);
+	idle = status->inflight == 0;
+	spin_unlock_irq(&status->results_queue_lock);
+	return idle;
+}
+
+static int cryptiface_release(struct inode *inode, struct file *file)
+{
+	struct cryptiface_status *status = file->private_data;
+	struct cryptiface_result *result;
+
+	// completion callbacks touch status until the last one is done
+	wait_event(status->inflight_waitqueue, cryptiface_idle(status));
+	while(!list_empty(&status->results_queue)) {
+		result = list_first_entry(&status->results_queue,
+					  struct cryptiface_result,
+					  result_list);
+		list_del(&result->result_list);
+		release_queue_space(status, result->sg_len * PAGE_SIZE);
+		free_cryptiface_result(result);
+	}
+	if(NULL != status->cipher) {
+		put_cryptiface_cipher(status->cipher);
+	}
+	if(NULL != status->ring) {
+		destroy_crypto_ring(status->ring);
+	}
+	kfree(status);
+	return 0;
+}
+
+static int cryptiface_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct cryptiface_status *status = file->private_data;
+	int err;
+
+	if(mutex_lock_interruptible(&status->ring_mutex)) {
+		return -ERESTARTSYS;
+	}
+	if(NULL == status->ring) {
+		printk(KERN_DEBUG "mmap of cryptiface without ring set up\n");
+		err = -EINVAL;
+	} else {
+		err = crypto_ring_mmap(status->ring, vma);
+	}
+	mutex_unlock(&status->ring_mutex);
+	return err;
+}
+
+
+static void update_data_ready(struct cryptiface_status *status)
+{
+	if(status->flags & CRYPTIFACE_F_TAGGED) {
+		// any result will do, readers tell them apart by cookie
+		status->has_data_ready = !list_empty(&status->ready_queue);
+		return;
+	}
+	status->has_data_ready = !list_empty(&status->results_queue)
+		&& list_first_entry(&status->results_queue,
+				    struct cryptiface_result,
+				    result_list)->done;
+}
+
+static void cryptiface_result_complete(struct cryptiface_result *result,
+				       int err)
+{
+	struct cryptiface_status *status = result->status;
+	unsigned long flags;
+
+	if(!err) {
+		count_cipher_op(result->cipher, result->encrypt);
+	}
+	spin_lock_irqsave(&status->results_queue_lock, flags);
+	result->err = err;
+	result->done = true;
+	list_add_tail(&result->ready_list, &status->ready_queue);
+	update_data_ready(status);
+	status->inflight--;
+	// Wake up under the lock: release() frees status as soon as it
+	// sees nothing in flight and gets hold of the lock.
+	if(status->has_data_ready) {
+		wake_up_interruptible(&status->new_result_waitqueue);
+	}
+	if(status->inflight == 0) {
+		wake_up(&status->inflight_waitqueue);
+	}
+	spin_unlock_irqrestore(&status->results_queue_lock, flags);
+}
+
+static void cryptiface_write_done(struct crypto_async_request *req, int err)
+{
+	struct cryptiface_result *result = req->data;
+	if(err == -EINPROGRESS) {
+		return;
+	}
+	finish_cipher_request(result->cipher, result->req, err);
+	cryptiface_result_complete(result, err);
+}
+
+static void cryptiface_parallel_done(void *data, int err)
+{
+	cryptiface_result_complete(data, err);
+}
+
+// Waits for the next result to read and returns it, still queued, with the
+// queue lock held.  That is the head of the queue once it is done, or in
+// CRYPTIFACE_F_TAGGED mode whichever result was done first.
+static struct cryptiface_result* wait_for_result(
+	struct cryptiface_status *status, bool nonblock)
+{
+	spin_lock_irq(&status->results_queue_lock);
+	while(!status->has_data_ready) {
+		spin_unlock_irq(&status->results_queue_lock);
+		if(nonblock) {
+			return ERR_PTR(-EAGAIN);
+		}
+		if(wait_event_interruptible(status->new_result_waitqueue,
+					    status->has_data_ready)) {
+			return ERR_PTR(-ERESTARTSYS);
+		}
+		spin_lock_irq(&status->results_queue_lock);
+	}
+	if(status->flags & CRYPTIFACE_F_TAGGED) {
+		return list_first_entry(&status->ready_queue,
+					struct cryptiface_result, ready_list);
+	}
+	return list_first_entry(&status->results_queue,
+				struct cryptiface_result, result_list);
+}
+
+// Appends a result that is not done yet.
+static void enqueue_result(struct cryptiface_status *status,
+			   struct cryptiface_result *result)
+{
+	trace_cryptiface_enqueue(result->cipher->context_id,
+				 result->cipher->algorithm, result->data_len);
+	spin_lock_irq(&status->results_queue_lock);
+	list_add_tail(&result->result_list, &status->results_queue);
+	status->results_count++;
+	status->results_bytes += result->data_len;
+	status->inflight++;
+	spin_unlock_irq(&status->results_queue_lock);
+}
+
+// Called with the queue lock held, drops it.
+static void dequeue_result(struct cryptiface_status *status,
+			   struct cryptiface_result *result)
+{
+	trace_cryptiface_dequeue(result->cipher->context_id,
+				 result->cipher->algorithm, result->data_len);
+	list_del(&result->result_list);
+	list_del(&result->ready_list);
+	status->results_count--;
+	status->results_bytes -= result->data_len - result->offset;
+	update_data_ready(status);
+	spin_unlock_irq(&status->results_queue_lock);
+	if(status->has_data_ready) {
+		wake_up(&status->new_result_waitqueue);
+	}
+}
+
+/*
+ * Copies out of the next result, leaving what does not fit for the next
+ * read.  With CRYPTIFACE_F_COALESCE it goes on with the results that are
+ * already finished.  A failed result is reported on its own, unless it is
+ * tagged: tagged results come behind a header carrying the status.
+ */
+static ssize_t read_results(struct cryptiface_status *status,
+			    struct iovec_cursor *cursor, size_t count,
+			    bool nonblock)
+{
+	bool coalesce = ACCESS_ONCE(status->flags) & CRYPTIFACE_F_COALESCE;
+	struct cryptiface_result *result_data;
+	struct __cryptiface_tag tag;
+	size_t to_copy, header, copied = 0;
+	ssize_t err = 0;
+
+	if(lock_counted(&status->read_mutex,
+			CRYPTO_STAT_READ_LOCK_CONTENDED)) {
+		return -ERESTARTSYS;
+	}
+	do {
+		// only wait for the first result
+		result_data = wait_for_result(status, nonblock || copied > 0);
+		if(IS_ERR(result_data)) {
+			err = PTR_ERR(result_data);
+			break;
+		}
+		header = result_data->tagged ? sizeof(tag) : 0;
+		// a tag comes with at least a byte of data, if there is any
+		if(header && (count - copied < header
+			      || (count - copied == header
+				  && !result_data->err))) {
+			spin_unlock_irq(&status->results_queue_lock);
+			if(copied == 0) {
+				printk(KERN_DEBUG "read too short for a tag\n");
+				err = -EINVAL;
+			}
+			break;
+		}
+		if(result_data->err && !result_data->tagged) {
+			if(copied > 0) {
+				spin_unlock_irq(&status->results_queue_lock);
+				break;
+			}
+			printk(KERN_DEBUG "encryption/decryption error\n");
+			err = result_data->err;
+			dequeue_result(status, result_data);
+			release_queue_space(status,
+					    result_data->sg_len * PAGE_SIZE);
+			free_cryptiface_result(result_data);
+			break;
+		}
+		spin_unlock_irq(&status->results_queue_lock);
+
+		to_copy = 0;
+		if(!result_data->err) {
+			to_copy = min(result_data->data_len
+				      - result_data->offset,
+				      count - copied - header);
+		}
+		if(header) {
+			tag.cookie = result_data->cookie;
+			tag.status = result_data->err;
+			tag.len = to_copy;
+			if(copy_to_iovec(cursor, &tag, sizeof(tag))) {
+				err = -EFAULT;
+				break;
+			}
+		}
+		if(copy_sg_to_user(cursor, result_data->sg,
+				   result_data->offset, to_copy)) {
+			err = -EFAULT;
+			break;
+		}
+		copied += header + to_copy;
+
+		spin_lock_irq(&status->results_queue_lock);
+		result_data->offset += to_copy;
+		status->results_bytes -= to_copy;
+		if(!result_data->err
+		   && result_data->offset < result_data->data_len) {
+			spin_unlock_irq(&status->results_queue_lock);
+			break;
+		}
+		dequeue_result(status, result_data);
+		release_queue_space(status, result_data->sg_len * PAGE_SIZE);
+		free_cryptiface_result(result_data);
+	} while(coalesce && copied < count);
+	mutex_unlock(&status->read_mutex);
+	return copied > 0 ? copied : err;
+}
+
+static ssize_t cryptiface_read_iovec(struct cryptiface_status *status,
+				     struct iovec_cursor *cursor,
+				     size_t count, bool nonblock)
+{
+	u64 start = local_clock();
+	ssize_t ret = read_results(status, cursor, count, nonblock);
+	crypto_stats_record_latency(CRYPTO_STAT_READ, local_clock() - start);
+	return ret;
+}
+
+static ssize_t cryptiface_read(struct file *file, char __user *buf,
+			       size_t count, loff_t *offp)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+	struct iovec_cursor cursor;
+	init_iovec_cursor(&cursor, &iov, 1);
+	return cryptiface_read_iovec(file->private_data, &cursor, count,
+				     file->f_flags & O_NONBLOCK);
+}
+
+static ssize_t cryptiface_aio_read(struct kiocb *iocb, const struct iovec *iov,
+				   unsigned long nr_segs, loff_t pos)
+{
+	struct iovec_cursor cursor;
+	init_iovec_cursor(&cursor, iov, nr_segs);
+	return cryptiface_read_iovec(iocb->ki_filp->private_data, &cursor,
+				     iov_length(iov, nr_segs),
+				     iocb->ki_filp->f_flags & O_NONBLOCK);
+}
+
+/*
+ * Takes the next place in the queue for data_len bytes transformed with
+ * the current cipher.  Only this is done under write_mutex; the data is
+ * copied and transformed afterwards, and results still come out in the
+ * order their writes took their places.
+ */
+static struct cryptiface_result* reserve_result(
+	struct cryptiface_status *status, size_t data_len)
+{
+	struct cryptiface_result *result_data;
+
+	result_data = kmem_cache_alloc(result_cache, GFP_KERNEL);
+	if(NULL == result_data) {
+		return NULL;
+	}
+	get_cryptiface_cipher(status->cipher);
+	result_data->sg = NULL;
+	result_data->sg_len = 0;
+	result_data->sg_given = 0;
+	result_data->data_len = data_len;
+	result_data->offset = 0;
+	memset(result_data->iv, 0, sizeof(result_data->iv));
+	result_data->status = status;
+	result_data->cipher = status->cipher;
+	result_data->encrypt = status->encrypt;
+	result_data->req = NULL;
+	result_data->done = false;
+	result_data->err = 0;
+	result_data->tagged = false;
+	result_data->cookie = 0;
+	enqueue_result(status, result_data);
+	return result_data;
+}
+
+// Takes a result that will never be done back out of the queue.
+static void cancel_result(struct cryptiface_result *result)
+{
+	struct cryptiface_status *status = result->status;
+
+	spin_lock_irq(&status->results_queue_lock);
+	list_del(&result->result_list);
+	status->results_count--;
+	status->results_bytes -= result->data_len;
+	// results behind it may be done already
+	update_data_ready(status);
+	if(status->has_data_ready) {
+		wake_up_interruptible(&status->new_result_waitqueue);
+	}
+	status->inflight--;
+	if(status->inflight == 0) {
+		wake_up(&status->inflight_waitqueue);
+	}
+	spin_unlock_irq(&status->results_queue_lock);
+	free_cryptiface_result(result);
+}
+
+// Keystream modes do not take a plain write without its own IV.  Called
+// with write_mutex held.
+static int check_write_iv(struct cryptiface_status *status)
+{
+	if(!status->has_write_iv
+	   && get_alg_info(status->cipher->algorithm)->unique_iv) {
+		printk(KERN_DEBUG "write without an IV\n");
+		return -EINVAL;
+	}
+	return 0;
+}
+
+// reserve_result() for a plain write, which uses up the IV set for it
+static struct cryptiface_result* reserve_write_result(
+	struct cryptiface_status *status, size_t data_len)
+{
+	struct cryptiface_result *result_data;
+
+	result_data = reserve_result(status, data_len);
+	if(NULL != result_data && status->has_write_iv) {
+		memcpy(result_data->iv, status->write_iv,
+		       sizeof(result_data->iv));
+		status->has_write_iv = false;
+	}
+	return result_data;
+}
+
+/*
+ * Transforms the data held in sg into a reserved result.  These take
+ * ownership of sg; the result is done or in the cipher's hands when they
+ * return 0, cancelled otherwise.
+ */
+static int queue_crypt(struct cryptiface_result *result,
+		       struct scatterlist *sg, int nents)
+{
+	struct cryptiface_cipher *cipher = result->cipher;
+	int err;
+
+	result->sg = sg;
+	result->sg_len = nents;
+	if(can_crypt_parallel(cipher, result->data_len)) {
+		err = crypt_parallel(cipher, sg, result->data_len, result->iv,
+				     result->encrypt, cryptiface_parallel_done,
+				     result);
+	} else {
+		result->req = alloc_cipher_request(cipher,
+						   cryptiface_write_done,
+						   result);
+		if(NULL == result->req) {
+			cancel_result(result);
+			return -ENOMEM;
+		}
+		ablkcipher_request_set_crypt(result->req, sg, sg,
+					     result->data_len, result->iv);
+		err = submit_cipher_request(cipher, result->req,
+					    result->encrypt);
+	}
+	if(err == 0) {
+		cryptiface_result_complete(result, 0);
+	} else if(err != -EINPROGRESS) {
+		printk(KERN_DEBUG "encryption/decryption error\n");
+		cancel_result(result);
+		return err;
+	}
+	return 0;
+}
+
+// for data the caller already transformed
+static int queue_finished(struct cryptiface_result *result,
+			  struct scatterlist *sg, int nents)
+{
+	result->sg = sg;
+	result->sg_len = nents;
+	cryptiface_result_complete(result, 0);
+	return 0;
+}
+
+/*
+ * Allocates, fills and hands to the cipher one piece of count bytes from
+ * the cursor at a time, so each piece is encrypted while still in cache
+ * and while the next one is copied.  The result keeps all of its pages
+ * until it is read, so this bounds the allocation ahead of the copy, not
+ * what the result holds in the end; the queue limits do that.
+ */
+static int queue_pipelined(struct cryptiface_result *result,
+			   struct iovec_cursor *cursor, size_t count)
+{
+	struct crypto_parallel_job *job;
+	struct scatterlist *sg;
+	size_t piece_len = parallel_piece_size();
+	size_t data_len = result->data_len, offset;
+	int nents = DIV_ROUND_UP(data_len, PAGE_SIZE), pages = 0;
+	int err = 0;
+
+	sg = alloc_sg_table(nents, GFP_KERNEL);
+	if(NULL == sg) {
+		cancel_result(result);
+		return -ENOMEM;
+	}
+	job = start_parallel_job(result->cipher, result->iv, result->encrypt,
+				 cryptiface_parallel_done, result);
+	if(NULL == job) {
+		free_sg_table(sg, nents);
+		cancel_result(result);
+		return -ENOMEM;
+	}
+
+	for(offset = 0; offset < data_len && !err; offset += piece_len) {
+		size_t len = min(piece_len, data_len - offset);
+		struct scatterlist *piece = &sg[offset / PAGE_SIZE];
+		if((err = alloc_data_pages(result->cipher, piece, len))) {
+			break;
+		}
+		pages += DIV_ROUND_UP(len, PAGE_SIZE);
+		// zero fills the padding of the last piece
+		err = copy_user_to_sg(piece, DIV_ROUND_UP(len, PAGE_SIZE), 0,
+				      cursor, min(len, count - offset));
+		if(!err) {
+			err = queue_parallel_piece(job, piece, offset, len);
+		}
+	}
+	if(err) {
+		abort_parallel_job(job);
+		free_data_pages(sg, pages);
+		free_sg_table(sg, nents);
+		cancel_result(result);
+		return err;
+	}
+	// all pages are in place before done() can see the result
+	result->sg = sg;
+	result->sg_len = nents;
+	finish_parallel_job(job, 0);
+	return 0;
+}
+
+/*
+ * Encrypts straight from the pinned user buffer into the result pages.
+ * The user may reuse the buffer once write() returns, so this one waits
+ * for the cipher.
+ */
+static int queue_pinned(struct cryptiface_result *result,
+			const char __user *buf, size_t count,
+			struct scatterlist *sg, int nents)
+{
+	size_t padded = result->data_len;
+	size_t aligned = rounddown(count, crypto_ablkcipher_blocksize(
+					   result->cipher->tfm));
+	struct pinned_buf src;
+	int err;
+
+	result->sg = sg;
+	result->sg_len = nents;
+	if((err = pin_user_buf(&src, buf, aligned, count - aligned,
+			       padded - aligned, 0))) {
+		goto cancel;
+	}
+	err = cipher_crypt_sync(result->cipher, src.sg, sg, padded, result->iv,
+				result->encrypt);
+	unpin_user_buf(&src, false);
+	if(err) {
+		printk(KERN_DEBUG "encryption/decryption error\n");
+		goto cancel;
+	}
+	cryptiface_result_complete(result, 0);
+	return 0;
+
+cancel:
+	cancel_result(result);
+	return err;
+}
+
+// CTR reports a block size of 1, but its counter moves a whole IV at a time
+static unsigned int stream_block_size(struct cryptiface_cipher *cipher)
+{
+	return max(crypto_ablkcipher_blocksize(cipher->tfm),
+		   crypto_ablkcipher_ivsize(cipher->tfm));
+}
+
+/*
+ * Transforms the whole blocks of the total bytes in sg, the stream's old
+ * tail followed by new data, and keeps the rest as the new tail.  Returns
+ * the bytes queued, 0 if there was no whole block.  Called with
+ * write_mutex held; takes ownership of sg.
+ */
+static ssize_t queue_stream(struct cryptiface_status *status,
+			    struct scatterlist *sg, int nents, size_t total)
+{
+	struct cryptiface_cipher *cipher = status->cipher;
+	size_t whole = rounddown(total, stream_block_size(cipher));
+	struct cryptiface_result *result_data = NULL;
+	u8 iv[CRYPTO_MAX_IV_LENGTH];
+	int err;
+
+	if(whole > 0) {
+		result_data = reserve_result(status, whole);
+		if(NULL == result_data) {
+			free_data_sg(sg, nents);
+			return -ENOMEM;
+		}
+	}
+	// the stream stays as it was if the cipher fails
+	memcpy(iv, status->stream_iv, sizeof(iv));
+	if(whole > 0 && (err = cipher_crypt_sync(cipher, sg, sg, whole, iv,
+						 status->encrypt))) {
+		printk(KERN_DEBUG "encryption/decryption error\n");
+		free_data_sg(sg, nents);
+		cancel_result(result_data);
+		return err;
+	}
+	memcpy(status->stream_iv, iv, sizeof(iv));
+	if(total > whole) {
+		// blocks never straddle pages
+		memcpy(status->stream_tail, sg_virt(&sg[whole >> PAGE_SHIFT])
+		       + offset_in_page(whole), total - whole);
+	}
+	status->stream_tail_len = total - whole;
+	if(whole == 0) {
+		free_data_sg(sg, nents);
+		return 0;
+	}
+	queue_finished(result_data, sg, nents);
+	return whole;
+}
+
+static ssize_t write_stream(struct cryptiface_status *status,
+			    struct iovec_cursor *cursor, size_t count,
+			    bool nonblock)
+{
+	size_t head = status->stream_tail_len;
+	size_t total = head + count;
+	struct scatterlist *sg;
+	ssize_t err;
+	int nents;
+
+	if(total < stream_block_size(status->cipher)) {
+		if(copy_from_iovec(status->stream_tail + head, cursor, count)) {
+			return -EFAULT;
+		}
+		status->stream_tail_len = total;
+		return count;
 	}
-	list_for_each(head, &status->results_queue) {
-		count++;
+	if((err = reserve_queue_space(status, PAGE_ALIGN(total), nonblock))) {
+		return err;
 	}
-	mutex_unlock(&status->results_queue_mutex);
-	return count;
+	sg = alloc_data_sg(status->cipher, total, &nents);
+	if(NULL == sg) {
+		err = -ENOMEM;
+	} else {
+		memcpy(sg_virt(&sg[0]), status->stream_tail, head);
+		if((err = copy_user_to_sg(sg, nents, head, cursor, count))) {
+			free_data_sg(sg, nents);
+		} else {
+			err = queue_stream(status, sg, nents, total);
+		}
+	}
+	if(err <= 0) {
+		release_queue_space(status, PAGE_ALIGN(total));
+	}
+	return err < 0 ? err : count;
 }
 
-static int cryptiface_ioctl_sizeresults(struct cryptiface_status *status,
-					size_t __user *results,
-					int count)
+/*
+ * Queues the partial block a stream is left with, zero padded to the
+ * block size like any other write, and leaves stream mode.  CTR, with its
+ * block size of 1, gives exactly as many bytes as are left.  Called with
+ * write_mutex held.
+ */
+static int end_stream(struct cryptiface_status *status, bool nonblock)
 {
-	int err;
-	int i;
-	struct cryptiface_result *result;
-	struct list_head *head;
-	if(mutex_lock_interruptible(&status->results_queue_mutex)) {
-		err = -ERESTARTSYS;
-		goto out;
+	struct cryptiface_cipher *cipher = status->cipher;
+	size_t len = status->stream_tail_len;
+	struct cryptiface_result *result_data;
+	size_t padded;
+	struct scatterlist *sg;
+	int nents, err;
+
+	if(!status->streaming) {
+		return 0;
 	}
-	i = 0;
-	list_for_each(head, &status->results_queue) {
-		if(i >= count) {
-			break;
+	if(len > 0) {
+		padded = roundup(len, crypto_ablkcipher_blocksize(cipher->tfm));
+		if((err = reserve_queue_space(status, PAGE_SIZE, nonblock))) {
+			return err;
 		}
-		result = list_entry(head, struct cryptiface_result,
-				    result_list);
-		if(copy_to_user(&results[i], &result->data_len,
-				sizeof(size_t))) {
-			err = -EFAULT;
-			goto mutex_unlock;
+		sg = alloc_data_sg(cipher, padded, &nents);
+		if(NULL == sg) {
+			release_queue_space(status, PAGE_SIZE);
+			return -ENOMEM;
 		}
-		i++;
+		result_data = reserve_result(status, padded);
+		if(NULL == result_data) {
+			free_data_sg(sg, nents);
+			release_queue_space(status, PAGE_SIZE);
+			return -ENOMEM;
+		}
+		memcpy(sg_virt(&sg[0]), status->stream_tail, len);
+		memset(sg_virt(&sg[0]) + len, 0, PAGE_SIZE - len);
+		err = cipher_crypt_sync(cipher, sg, sg, padded,
+					status->stream_iv, status->encrypt);
+		if(err) {
+			printk(KERN_DEBUG "encryption/decryption error\n");
+			free_data_sg(sg, nents);
+			cancel_result(result_data);
+			release_queue_space(status, PAGE_SIZE);
+			return err;
+		}
+		queue_finished(result_data, sg, nents);
 	}
-	err = i;
-mutex_unlock:
-	mutex_unlock(&status->results_queue_mutex);
-out:
-	return err;
+	status->streaming = false;
+	status->stream_tail_len = 0;
+	return 0;
 }
 
-static int cryptiface_open(struct inode *inode, struct file *file)
+static int cryptiface_ioctl_stream(struct cryptiface_status *status,
+				   int enable, const u8 __user *iv,
+				   size_t iv_len, bool nonblock)
 {
-	struct crypto_db *db;
-	struct cryptiface_status *status = kmalloc(sizeof(*status), GFP_KERNEL);
+	u8 new_iv[CRYPTO_MAX_IV_LENGTH] = {0};
+	struct cryptiface_cipher *cipher;
+	enum crypto_alg_split split;
 	int err;
-	if(NULL == status) {
-		return -ENOMEM;
+
+	if(enable && NULL != iv) {
+		if(iv_len > sizeof(new_iv)) {
+			return -EINVAL;
+		}
+		if(copy_from_user(new_iv, iv, iv_len)) {
+			return -EFAULT;
+		}
 	}
-	if(mutex_lock_interruptible(&get_cryptodev()->crypto_dbs_mutex)) {
-		err = -ERESTARTSYS;
-		goto fail;
+	if(mutex_lock_interruptible(&status->write_mutex)) {
+		return -ERESTARTSYS;
 	}
-	db = get_or_create_crypto_db(&get_cryptodev()->crypto_dbs,
-				     current_euid());
-	mutex_unlock(&get_cryptodev()->crypto_dbs_mutex);
-	if(NULL == db) {
-		err = -ENOMEM;
-		goto fail;
+	if((err = end_stream(status, nonblock)) || !enable) {
+		goto out;
 	}
-	status->tfm = NULL;
-	status->db = db;
-	status->has_data_ready = false;
-	mutex_init(&status->write_mutex);
-	init_waitqueue_head(&status->new_result_waitqueue);
-	mutex_init(&status->results_queue_mutex);
-	INIT_LIST_HEAD(&status->results_queue);
-	file->private_data = status;
-	return 0;
-fail:
-	kfree(status);
-	return err;
-}
-
-static int cryptiface_release(struct inode *inode, struct file *file)
-{
-	struct cryptiface_status *status = file->private_data;
-	if(NULL != status->tfm) {
-		crypto_free_blkcipher(status->tfm);
+	cipher = status->cipher;
+	if(NULL == cipher) {
+		printk(KERN_DEBUG "stream on cryptiface without setting key\n");
+		err = -EINVAL;
+		goto out;
 	}
-	kfree(status);
-	return 0;
+	split = get_alg_info(cipher->algorithm)->split;
+	if((split != CRYPTO_SPLIT_CHAIN && split != CRYPTO_SPLIT_COUNTER)
+	   || stream_block_size(cipher) > sizeof(status->stream_tail)) {
+		printk(KERN_DEBUG "algorithm %d cannot stream\n",
+		       cipher->algorithm);
+		err = -EINVAL;
+		goto out;
+	}
+	if(NULL != iv && iv_len != crypto_ablkcipher_ivsize(cipher->tfm)) {
+		printk(KERN_DEBUG "stream IV of wrong length: %zu\n", iv_len);
+		err = -EINVAL;
+		goto out;
+	}
+	if(NULL == iv && get_alg_info(cipher->algorithm)->unique_iv) {
+		printk(KERN_DEBUG "keystream without an IV\n");
+		err = -EINVAL;
+		goto out;
+	}
+	memcpy(status->stream_iv, new_iv, sizeof(new_iv));
+	status->stream_tail_len = 0;
+	status->streaming = true;
+out:
+	mutex_unlock(&status->write_mutex);
+	return err;
 }
 
-
-static ssize_t cryptiface_read(struct file *file, char __user *buf,
-			       size_t count, loff_t *offp)
+static ssize_t queue_write(struct cryptiface_status *status,
+			   struct iovec_cursor *cursor, size_t count,
+			   bool nonblock)
 {
-	struct cryptiface_status *status = file->private_data;
+	bool tagged = ACCESS_ONCE(status->flags) & CRYPTIFACE_F_TAGGED;
 	struct cryptiface_result *result_data;
-	int i; int err;
-	size_t buf_avail = count;
+	struct scatterlist *sg;
+	unsigned int block_size;
+	size_t header = 0;
+	u64 cookie = 0;
+	bool pin, reserved;
+	int nents;
+	ssize_t err;
 
-	if(mutex_lock_interruptible(&status->results_queue_mutex)) {
-		return -ERESTARTSYS;
+	if(count == 0) {
+		return 0;
 	}
-	while(!status->has_data_ready) {
-		mutex_unlock(&status->results_queue_mutex);
-		if(wait_event_interruptible(status->new_result_waitqueue,
-					    status->has_data_ready)) {
-			return -ERESTARTSYS;
+	if(tagged) {
+		header = sizeof(cookie);
+		if(count <= header) {
+			printk(KERN_DEBUG "tagged write without data\n");
+			return -EINVAL;
 		}
-		if(mutex_lock_interruptible(&status->results_queue_mutex)) {
-			return -ERESTARTSYS;
+		if(copy_from_iovec(&cookie, cursor, header)) {
+			return -EFAULT;
 		}
+		count -= header;
 	}
-	result_data = list_first_entry(&status->results_queue,
-				       struct cryptiface_result,
-				       result_list);
-	list_del(&result_data->result_list);
-	if(list_empty(&status->results_queue)) {
-		status->has_data_ready = false;
-		mutex_unlock(&status->results_queue_mutex);
-	} else {
-		mutex_unlock(&status->results_queue_mutex);
-		wake_up(&status->new_result_waitqueue);
+again:
+	// streams chain, so they stay serialized and account for themselves
+	// under the mutex
+	reserved = !ACCESS_ONCE(status->streaming);
+	if(reserved && (err = reserve_queue_space(status, PAGE_ALIGN(count),
+						  nonblock))) {
+		return err;
 	}
-	for(i = 0; i<result_data->sg_len
-		    && result_data->data_len > 0
-		    && buf_avail > 0; i++) {
-		void* virt = sg_virt(&result_data->sg[i]);
-		size_t to_copy = min(min((size_t) PAGE_SIZE,
-					 result_data->data_len),
-				     buf_avail);
-		if(copy_to_user(buf, virt, to_copy)) {
-			err = -EFAULT;
-			goto free_pages;
+
+	// Writers only take their place in the queue under the mutex, and
+	// copy and transform their data concurrently.
+	if(lock_counted(&status->write_mutex,
+			CRYPTO_STAT_WRITE_LOCK_CONTENDED)) {
+		err = -ERESTARTSYS;
+		goto release_space;
+	}
+	if(NULL == status->cipher) {
+		printk(KERN_DEBUG
+		       "writing to cryptiface without setting key\n");
+		mutex_unlock(&status->write_mutex);
+		err = -EINVAL;
+		goto release_space;
+	}
+	if(!reserved && !status->streaming) {
+		// the stream ended while we waited for the mutex
+		mutex_unlock(&status->write_mutex);
+		goto again;
+	}
+	trace_cryptiface_submit(status->cipher->context_id,
+				status->cipher->algorithm, count);
+	if(status->streaming && tagged) {
+		printk(KERN_DEBUG "tagged write to a stream\n");
+		mutex_unlock(&status->write_mutex);
+		err = -EINVAL;
+		goto release_space;
+	}
+	if(status->streaming) {
+		if(reserved) {
+			// the stream started while we waited for room
+			release_queue_space(status, PAGE_ALIGN(count));
 		}
-		buf += to_copy;
-		result_data->data_len -= to_copy;
-		buf_avail -= to_copy;
+		err = write_stream(status, cursor, count, nonblock);
+		mutex_unlock(&status->write_mutex);
+		return err;
 	}
+	if((err = check_write_iv(status))) {
+		mutex_unlock(&status->write_mutex);
+		goto release_space;
+	}
+	block_size = crypto_ablkcipher_blocksize(status->cipher->tfm);
+	result_data = reserve_write_result(status, roundup(count, block_size));
+	pin = status->flags & CRYPTIFACE_F_PIN_USER;
+	mutex_unlock(&status->write_mutex);
+	if(NULL == result_data) {
+		err = -ENOMEM;
+		goto release_space;
+	}
+	// nobody looks at it before it is done
+	result_data->tagged = tagged;
+	result_data->cookie = cookie;
 
-	err = count-buf_avail;
-free_pages:
-	for(i = 0; i<result_data->sg_len && result_data->data_len > 0; i++) {
-		unsigned long virt =
-			(unsigned long) sg_virt(&result_data->sg[i]);
-		free_page(virt);
+	pin = pin && count >= pin_threshold && cursor->nr_segs == 1;
+	if(!pin && can_crypt_pipelined(result_data->cipher, count)) {
+		// splittable modes spread these pieces over the CPUs as
+		// crypt_parallel() does for data that is already in place
+		err = queue_pipelined(result_data, cursor, count);
+	} else if(NULL == (sg = alloc_data_sg(result_data->cipher, count,
+					      &nents))) {
+		cancel_result(result_data);
+		err = -ENOMEM;
+	} else if(pin) {
+		err = queue_pinned(result_data,
+				   cursor->iov->iov_base + cursor->offset,
+				   count, sg, nents);
+	} else if((err = copy_user_to_sg(sg, nents, 0, cursor, count))) {
+		free_data_sg(sg, nents);
+		cancel_result(result_data);
+	} else {
+		err = queue_crypt(result_data, sg, nents);
+	}
+	if(!err) {
+		return header + count;
+	}
+release_space:
+	// nothing was queued
+	if(reserved) {
+		release_queue_space(status, PAGE_ALIGN(count));
 	}
-	kfree(result_data->sg);
-	kfree(result_data);
 	return err;
 }
 
+static ssize_t cryptiface_write_iovec(struct cryptiface_status *status,
+				      struct iovec_cursor *cursor,
+				      size_t count, bool nonblock)
+{
+	u64 start = local_clock();
+	ssize_t ret = queue_write(status, cursor, count, nonblock);
+	crypto_stats_record_latency(CRYPTO_STAT_WRITE, local_clock() - start);
+	return ret;
+}
+
 static ssize_t cryptiface_write(struct file *file, const char __user *buf,
 			       size_t count, loff_t *offp)
 {
-	struct cryptiface_status *status = file->private_data;
-	struct cryptiface_result *result_data;
-	int page_count = count/PAGE_SIZE;
-	size_t remaining_data = count;
-	int i; int err;
-	char *page; char **pages;
+	struct iovec iov = { .iov_base = (void __user *) buf,
+			     .iov_len = count };
+	struct iovec_cursor cursor;
+	init_iovec_cursor(&cursor, &iov, 1);
+	return cryptiface_write_iovec(file->private_data, &cursor, count,
+				      file->f_flags & O_NONBLOCK);
+}
+
+static ssize_t cryptiface_aio_write(struct kiocb *iocb,
+				    const struct iovec *iov,
+				    unsigned long nr_segs, loff_t pos)
+{
+	struct iovec_cursor cursor;
+	init_iovec_cursor(&cursor, iov, nr_segs);
+	return cryptiface_write_iovec(iocb->ki_filp->private_data, &cursor,
+				      iov_length(iov, nr_segs),
+				      iocb->ki_filp->f_flags & O_NONBLOCK);
+}
+
+struct splice_target {
 	struct scatterlist *sg;
-	struct blkcipher_desc desc;
-	if(NULL == status->tfm) {
-		printk(KERN_DEBUG "writing to cryptiface without setting key\n");
-		return -EINVAL;
+	size_t offset;
+};
+
+static int cryptiface_splice_actor(struct pipe_inode_info *pipe,
+				   struct pipe_buffer *buf,
+				   struct splice_desc *sd)
+{
+	struct splice_target *target = sd->u.data;
+	size_t remaining = sd->len;
+	char *mapped, *src;
+	int err;
+
+	if((err = buf->ops->confirm(pipe, buf))) {
+		return err;
+	}
+	mapped = buf->ops->map(pipe, buf, 0);
+	src = mapped + buf->offset;
+	while(remaining > 0) {
+		char *page = sg_virt(&target->sg[target->offset >> PAGE_SHIFT]);
+		size_t in_page = offset_in_page(target->offset);
+		size_t n = min(remaining, (size_t) (PAGE_SIZE - in_page));
+		memcpy(page + in_page, src, n);
+		src += n;
+		target->offset += n;
+		remaining -= n;
 	}
+	buf->ops->unmap(pipe, buf, mapped);
+	return sd->len;
+}
 
-	// To avoid potential corruption of encryption context,
-	// only one process can be writing to a given fd at a time
-	if(mutex_lock_interruptible(&status->write_mutex)) {
+/*
+ * Pipe contents are copied straight from the pipe buffers into our pages,
+ * one result per call.  One call takes at most what a full pipe holds.  In
+ * a stream they go after its tail.
+ */
+static ssize_t cryptiface_splice_write(struct pipe_inode_info *pipe,
+				       struct file *out, loff_t *ppos,
+				       size_t len, unsigned int flags)
+{
+	struct cryptiface_status *status = out->private_data;
+	struct cryptiface_result *result_data;
+	struct splice_target target;
+	struct splice_desc sd = {
+		.flags = flags,
+		.pos = *ppos,
+		.u.data = &target,
+	};
+	size_t head, reserved;
+	unsigned int block_size;
+	int nents;
+	ssize_t ret, err;
+
+	len = min(len, (size_t) (pipe->buffers*PAGE_SIZE));
+	if(len == 0) {
+		return 0;
+	}
+	if(lock_counted(&status->write_mutex,
+			CRYPTO_STAT_WRITE_LOCK_CONTENDED)) {
 		return -ERESTARTSYS;
 	}
-
-	if(count % PAGE_SIZE != 0) {
-		page_count++;
+	if(NULL == status->cipher) {
+		printk(KERN_DEBUG
+		       "splicing to cryptiface without setting key\n");
+		ret = -EINVAL;
+		goto out;
 	}
-
-	result_data = kmalloc(sizeof(*result_data), GFP_KERNEL);
-	if(NULL == result_data) {
-		err = -ENOMEM;
+	if(status->flags & CRYPTIFACE_F_TAGGED) {
+		// there is no telling where a cookie would end in a pipe
+		printk(KERN_DEBUG "splicing to cryptiface in tagged mode\n");
+		ret = -EINVAL;
 		goto out;
 	}
-
-	pages = kmalloc(page_count*sizeof(*pages), GFP_KERNEL);
-	if(NULL == pages) {
-		err = -ENOMEM;
-		goto free_result_data;
+	if(!status->streaming && (ret = check_write_iv(status))) {
+		goto out;
 	}
+	trace_cryptiface_submit(status->cipher->context_id,
+				status->cipher->algorithm, len);
+	head = status->streaming ? status->stream_tail_len : 0;
+	reserved = PAGE_ALIGN(head + len);
+	if((ret = reserve_queue_space(status, reserved,
+				      (flags & SPLICE_F_NONBLOCK)
+				      || (out->f_flags & O_NONBLOCK)))) {
+		goto out;
+	}
+	target.sg = alloc_data_sg(status->cipher, head + len, &nents);
+	if(NULL == target.sg) {
+		ret = -ENOMEM;
+		goto release_space;
+	}
+	memcpy(sg_virt(&target.sg[0]), status->stream_tail, head);
+	target.offset = head;
+	sd.total_len = len;
 
-	sg = kmalloc(page_count*sizeof(*sg), GFP_KERNEL);
-	if(NULL == sg) {
-		err = -ENOMEM;
-		goto free_pages_list;
+	pipe_lock(pipe);
+	ret = __splice_from_pipe(pipe, &sd, cryptiface_splice_actor);
+	pipe_unlock(pipe);
+	if(ret <= 0) {
+		free_data_sg(target.sg, nents);
+		goto release_space;
 	}
-	sg_init_table(sg, page_count);
-	for(i = 0; i<page_count; i++) {
-		size_t to_copy = min(remaining_data, (size_t) PAGE_SIZE);
-		page = (void*) __get_free_page(GFP_KERNEL);
-		if(NULL == page) {
-			i--;
+	if(offset_in_page(target.offset) != 0) {
+		// zero fill
+		char *page = sg_virt(&target.sg[target.offset >> PAGE_SHIFT]);
+		memset(page + offset_in_page(target.offset), 0,
+		       PAGE_SIZE - offset_in_page(target.offset));
+	}
+	if(status->streaming) {
+		err = queue_stream(status, target.sg, nents, target.offset);
+	} else {
+		block_size = crypto_ablkcipher_blocksize(status->cipher->tfm);
+		result_data = reserve_write_result(status,
+						   roundup(ret, block_size));
+		if(NULL == result_data) {
+			free_data_sg(target.sg, nents);
 			err = -ENOMEM;
-			goto err_free_pages;
+		} else {
+			err = queue_crypt(result_data, target.sg, nents);
 		}
-		pages[i] = page;
-		if(copy_from_user(page, buf, to_copy)) {
-			err = -EFAULT;
-			goto err_free_pages;
-		}
-		buf += to_copy;
-		if(remaining_data < PAGE_SIZE) {
-			// zero fill
-			memset(page+remaining_data, 0,
-			       PAGE_SIZE-remaining_data);
-		}
-		sg_set_buf(&sg[i], page, PAGE_SIZE);
-		remaining_data -= min(remaining_data, (size_t) PAGE_SIZE);
-	}
-
-	desc.tfm = status->tfm;
-	desc.flags = 0;
-	// TODO: %8 is DES only
-	remaining_data = count + ((count%8 !=0) ? 8 - count%8 : 0);
-	printk(KERN_DEBUG "count: %zd, remaining_data: %zd\n", count,
-	       remaining_data);
-	if(status->encrypt) {
-		err = crypto_blkcipher_encrypt(&desc, sg, sg,
-					       remaining_data);
-	} else {
-		err = crypto_blkcipher_decrypt(&desc, sg, sg,
-					       remaining_data);
 	}
-	if(err) {
-		printk(KERN_DEBUG "encryption/decryption error\n");
-		i = page_count-1;
-		goto err_free_pages;
+	if(err < 0) {
+		ret = err;
+		goto release_space;
 	}
+	if(status->streaming && err == 0) {
+		// all of it went into the tail
+		goto release_space;
+	}
+	goto out;
 
-	result_data->sg = sg;
-	result_data->sg_len = page_count;
-	result_data->data_len = remaining_data;
+release_space:
+	release_queue_space(status, reserved);
+out:
+	mutex_unlock(&status->write_mutex);
+	return ret;
+}
 
-	if(mutex_lock_interruptible(&status->results_queue_mutex)) {
-		err = -ERESTARTSYS;
-		i = page_count-1;
-		goto err_free_pages;
+static void cryptiface_pipe_buf_release(struct pipe_inode_info *pipe,
+					struct pipe_buffer *buf)
+{
+	page_cache_release(buf->page);
+}
+
+static const struct pipe_buf_operations cryptiface_pipe_buf_ops = {
+	.can_merge = 0,
+	.map = generic_pipe_buf_map,
+	.unmap = generic_pipe_buf_unmap,
+	.confirm = generic_pipe_buf_confirm,
+	.release = cryptiface_pipe_buf_release,
+	.steal = generic_pipe_buf_steal,
+	.get = generic_pipe_buf_get,
+};
+
+static void cryptiface_spd_release(struct splice_pipe_desc *spd,
+				   unsigned int i)
+{
+	put_page(spd->pages[i]);
+}
+
+/*
+ * The unread pages of a finished result are handed to the pipe without
+ * copying, as many whole pages as fit into len.  The result stays queued
+ * until the pipe took them, and what it had no room for is left to the
+ * next read.  A result whose first page does not fit into len, or that
+ * needs a tag in front, goes through read() instead.
+ */
+static ssize_t cryptiface_splice_read(struct file *in, loff_t *ppos,
+				      struct pipe_inode_info *pipe,
+				      size_t len, unsigned int flags)
+{
+	struct cryptiface_status *status = in->private_data;
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct splice_pipe_desc spd = {
+		.pages = pages,
+		.partial = partial,
+		.nr_pages_max = PIPE_DEF_BUFFERS,
+		.flags = flags,
+		.ops = &cryptiface_pipe_buf_ops,
+		.spd_release = cryptiface_spd_release,
+	};
+	struct cryptiface_result *result;
+	size_t remaining, in_page, spliced = 0;
+	int i, nr, first;
+	ssize_t ret;
+
+	if(lock_counted(&status->read_mutex,
+			CRYPTO_STAT_READ_LOCK_CONTENDED)) {
+		return -ERESTARTSYS;
+	}
+	result = wait_for_result(status, (flags & SPLICE_F_NONBLOCK)
+				 || (in->f_flags & O_NONBLOCK));
+	if(IS_ERR(result)) {
+		mutex_unlock(&status->read_mutex);
+		return PTR_ERR(result);
+	}
+	if(result->err || result->tagged) {
+		spin_unlock_irq(&status->results_queue_lock);
+		goto read_instead;
 	}
-	list_add_tail(&result_data->result_list, &status->results_queue);
-	status->has_data_ready = true;
-	mutex_unlock(&status->results_queue_mutex);
-	wake_up_interruptible(&status->new_result_waitqueue);
+	spin_unlock_irq(&status->results_queue_lock);
 
-	kfree(pages);
-	err = count;
-	goto out;
+	first = result->offset >> PAGE_SHIFT;
+	in_page = offset_in_page(result->offset);
+	remaining = result->data_len - result->offset;
+	for(nr = 0; nr < PIPE_DEF_BUFFERS && remaining > 0; nr++) {
+		partial[nr].len = min(remaining, (size_t) PAGE_SIZE - in_page);
+		if(spliced + partial[nr].len > len) {
+			break;
+		}
+		partial[nr].offset = in_page;
+		partial[nr].private = 0;
+		pages[nr] = sg_page(&result->sg[first + nr]);
+		// the pipe's reference, dropped again if it has no room
+		get_page(pages[nr]);
+		spliced += partial[nr].len;
+		remaining -= partial[nr].len;
+		in_page = 0;
+	}
+	if(nr == 0) {
+		goto read_instead;
+	}
+	spd.nr_pages = nr;
+	ret = splice_to_pipe(pipe, &spd);
+	if(ret <= 0) {
+		mutex_unlock(&status->read_mutex);
+		return ret;
+	}
 
-err_free_pages:
-	kfree(sg);
-	for(;i >= 0; i--) {
-		free_page((unsigned long) pages[i]);
+	// The pipe took the first pages it had room for.  It owns them now,
+	// and the ones read before them go back to the pool.
+	for(nr = 0, spliced = 0; spliced < ret; nr++) {
+		spliced += partial[nr].len;
 	}
-free_pages_list:
-	kfree(pages);
-free_result_data:
-	kfree(result_data);
-out:
-	mutex_unlock(&status->write_mutex);
-	return err;
+	free_data_pages(result->sg + result->sg_given,
+			first - result->sg_given);
+	for(i = 0; i<nr; i++) {
+		put_page(pages[i]);
+	}
+	result->sg_given = first + nr;
+	spin_lock_irq(&status->results_queue_lock);
+	result->offset += ret;
+	status->results_bytes -= ret;
+	if(result->offset < result->data_len) {
+		spin_unlock_irq(&status->results_queue_lock);
+	} else {
+		dequeue_result(status, result);
+		release_queue_space(status, result->sg_len * PAGE_SIZE);
+		free_cryptiface_result(result);
+	}
+	mutex_unlock(&status->read_mutex);
+	return ret;
+
+read_instead:
+	// read() takes the mutex itself
+	mutex_unlock(&status->read_mutex);
+	return default_file_splice_read(in, ppos, pipe, len, flags);
+}
+
+static unsigned int cryptiface_poll(struct file *file, poll_table *wait)
+{
+	struct cryptiface_status *status = file->private_data;
+	struct crypto_db *db = status->db;
+	unsigned int mask = 0;
+
+	poll_wait(file, &status->new_result_waitqueue, wait);
+	poll_wait(file, &db->queue_space_waitqueue, wait);
+	spin_lock_irq(&status->results_queue_lock);
+	if(status->has_data_ready) {
+		mask |= POLLIN | POLLRDNORM;
+	}
+	spin_unlock_irq(&status->results_queue_lock);
+	// room for at least a page
+	spin_lock(&db->queue_space_lock);
+	if(queue_space_fits(status, PAGE_SIZE)) {
+		mask |= POLLOUT | POLLWRNORM;
+	}
+	spin_unlock(&db->queue_space_lock);
+	return mask;
 }
 
 static long cryptiface_ioctl(struct file *file, unsigned int cmd,
@@ -495,7 +2178,8 @@ static long cryptiface_ioctl(struct file *file, unsigned int cmd,
 		return cryptiface_ioctl_setcurrent(file->private_data,
 						   op_info.algorithm,
 						   op_info.context_id,
-						   op_info.encrypt);
+						   op_info.encrypt,
+						   file->f_flags & O_NONBLOCK);
 	}
 	case CRYPTIFACE_ADDKEY_NR: {
 		struct __cryptiface_addkey_op op_info;
@@ -541,6 +2225,105 @@ static long cryptiface_ioctl(struct file *file, unsigned int cmd,
 						    op_info.count);
 
 	}
+	case CRYPTIFACE_STREAM_NR: {
+		struct __cryptiface_stream_op op_info;
+		if(copy_from_user(&op_info, (void __user *)arg,
+				  sizeof(op_info))) {
+			return -EFAULT;
+		}
+		return cryptiface_ioctl_stream(file->private_data,
+					       op_info.enable,
+					       op_info.iv,
+					       op_info.iv_len,
+					       file->f_flags & O_NONBLOCK);
+	}
+	case CRYPTIFACE_STATS_NR: {
+		struct __cryptiface_stats __user *user_stats =
+			(void __user *)arg;
+		struct __cryptiface_stats *stats;
+		__u32 size;
+		if(get_user(size, &user_stats->header.size)) {
+			return -EFAULT;
+		}
+		if(size < sizeof(struct __cryptiface_stats_header)) {
+			printk(KERN_DEBUG "stats buffer too small: %u\n", size);
+			return -EINVAL;
+		}
+		// older callers get the part they know of
+		size = min_t(size_t, size, sizeof(*stats));
+		stats = kmalloc(sizeof(*stats), GFP_KERNEL);
+		if(NULL == stats) {
+			return -ENOMEM;
+		}
+		get_crypto_stats(stats);
+		stats->header.size = size;
+		err = 0;
+		if(copy_to_user(user_stats, stats, size)) {
+			err = -EFAULT;
+		}
+		kfree(stats);
+		return err;
+	}
+	case CRYPTIFACE_RESULTSTAT_NR: {
+		struct __cryptiface_resultstat_op op_info;
+		cryptiface_ioctl_resultstat(file->private_data, &op_info);
+		if(copy_to_user((void __user *)arg, &op_info,
+				sizeof(op_info))) {
+			return -EFAULT;
+		}
+		return 0;
+	}
+	case CRYPTIFACE_RING_SETUP_NR: {
+		struct __cryptiface_ring_setup_op op_info;
+		if(copy_from_user(&op_info, (void __user *)arg,
+				  sizeof(op_info))) {
+			return -EFAULT;
+		}
+		err = cryptiface_ioctl_ring_setup(file->private_data,
+						  op_info.entries,
+						  op_info.data_size,
+						  &op_info.mmap_size);
+		if(err) {
+			return err;
+		}
+		if(copy_to_user((void __user *)arg, &op_info,
+				sizeof(op_info))) {
+			return -EFAULT;
+		}
+		return 0;
+	}
+	case CRYPTIFACE_RING_ENTER_NR: {
+		return cryptiface_ioctl_ring_enter(file->private_data);
+	}
+	case CRYPTIFACE_SETFLAGS_NR: {
+		struct __cryptiface_setflags_op op_info;
+		if(copy_from_user(&op_info, (void __user *)arg,
+				  sizeof(op_info))) {
+			return -EFAULT;
+		}
+		return cryptiface_ioctl_setflags(file->private_data,
+						 op_info.flags);
+	}
+	case CRYPTIFACE_BATCH_NR: {
+		struct __cryptiface_batch_op op_info;
+		if(copy_from_user(&op_info, (void __user *)arg,
+				  sizeof(op_info))) {
+			return -EFAULT;
+		}
+		return cryptiface_ioctl_batch(file->private_data,
+					      op_info.algorithm,
+					      op_info.entries,
+					      op_info.count);
+	}
+	case CRYPTIFACE_SETIV_NR: {
+		struct __cryptiface_setiv_op op_info;
+		if(copy_from_user(&op_info, (void __user *)arg,
+				  sizeof(op_info))) {
+			return -EFAULT;
+		}
+		return cryptiface_ioctl_setiv(file->private_data,
+					      op_info.iv, op_info.iv_len);
+	}
 	default: // shouldn't happen
 		err = -ENOTTY;
 	}
@@ -552,17 +2335,31 @@ static struct file_operations cryptodev_fops = {
 	.open = cryptiface_open,
 	.read = cryptiface_read,
 	.write = cryptiface_write,
+	.aio_read = cryptiface_aio_read,
+	.aio_write = cryptiface_aio_write,
+	.splice_read = cryptiface_splice_read,
+	.splice_write = cryptiface_splice_write,
+	.poll = cryptiface_poll,
 	.unlocked_ioctl = cryptiface_ioctl,
+	.mmap = cryptiface_mmap,
 	.release = cryptiface_release
 };
 
 int create_cryptiface(void)
 {
-	int err;
+	int err, i;
 
-        INIT_LIST_HEAD(&cryptodev.crypto_dbs);
+	for(i = 0; i<CRYPTO_DB_HASH_SIZE; i++) {
+		INIT_LIST_HEAD(&cryptodev.crypto_dbs[i]);
+	}
 	mutex_init(&cryptodev.crypto_dbs_mutex);
 
+	result_cache = KMEM_CACHE(cryptiface_result, 0);
+	if(NULL == result_cache) {
+		err = -ENOMEM;
+		goto create_cache_fail;
+	}
+
 	crypto_class = class_create(THIS_MODULE, "crypto");
 	if(IS_ERR(crypto_class)) {
 		err = PTR_ERR(crypto_class);
@@ -601,21 +2398,30 @@ cdev_add_fail:
 alloc_chrdev_fail:
         class_destroy(crypto_class);
 create_class_fail:
+	kmem_cache_destroy(result_cache);
+create_cache_fail:
 	return err;
 }
 
 void destroy_cryptiface(void)
 {
+	int i;
+
 	mutex_lock(&get_cryptodev()->crypto_dbs_mutex);
-	while(!list_empty(&cryptodev.crypto_dbs)) {
-		struct crypto_db *db = list_first_entry(
-			&cryptodev.crypto_dbs, struct crypto_db, db_list);
-		list_del(&db->db_list);
-		kfree(db);
+	// no file is open any more, so nobody walks the buckets
+	for(i = 0; i<CRYPTO_DB_HASH_SIZE; i++) {
+		while(!list_empty(&cryptodev.crypto_dbs[i])) {
+			struct crypto_db *db = list_first_entry(
+				&cryptodev.crypto_dbs[i], struct crypto_db,
+				db_list);
+			list_del(&db->db_list);
+			destroy_crypto_db(db);
+		}
 	}
 	device_destroy(crypto_class, cryptodev.dev);
 	cdev_del(&cryptodev.cdev);
 	unregister_chrdev_region(cryptodev.dev, 1);
 	class_destroy(crypto_class);
+	kmem_cache_destroy(result_cache);
 	mutex_unlock(&get_cryptodev()->crypto_dbs_mutex);
 }
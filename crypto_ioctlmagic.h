@@ -1,4 +1,5 @@
 /* -*- mode: C; fill-column: 80; c-file-style: "linux"; indent-tabs-mode: t  -*- */
+#include <linux/types.h>
 
 struct __cryptiface_setcurrent_op {
 	int algorithm;
@@ -22,16 +23,226 @@ struct __cryptiface_sizeresults_op {
 	int count;
 };
 
+/* enough for the IV of every algorithm */
+enum { CRYPTIFACE_MAX_IV_SIZE = 16 };
+
+/*
+ * Sets the IV the next write() or splice() on the fd starts from.  It is
+ * used up by that write; iv_len has to be the cipher's IV size.
+ */
+struct __cryptiface_setiv_op {
+	const unsigned char *iv;
+	size_t iv_len;
+};
+
+/*
+ * Makes the writes on an fd one message, for CBC and CTR: the IV carries
+ * over from one write to the next, and a trailing partial block waits for
+ * the next write.  Ending the stream, or setting another key, queues what
+ * is left, zero padded to the block size for CBC.  iv may be NULL for an
+ * all-zero one, except with CTR.
+ */
+struct __cryptiface_stream_op {
+	int enable;
+	const unsigned char *iv;
+	size_t iv_len;
+};
+
+/* what is queued on an fd, taken at one instant */
+struct __cryptiface_resultstat_op {
+	int count;		/* results queued, finished or not */
+	size_t bytes;		/* bytes left to read in them */
+	size_t head_size;	/* bytes left to read in the first, 0 if none */
+};
+
+struct __cryptiface_ring_setup_op {
+	unsigned int entries;	/* slots in each ring, power of two */
+	size_t data_size;	/* size of the shared data area */
+	size_t mmap_size;	/* filled in: length to pass to mmap() */
+};
+
+/*
+ * Layout of the area mapped with mmap() after CRYPTIFACE_IOCTL_RING_SETUP.
+ * The header sits at offset 0, the other parts at the offsets it records.
+ * Userspace fills sqes[sq_tail & (entries-1)] and bumps sq_tail, then calls
+ * CRYPTIFACE_IOCTL_RING_ENTER.  The kernel transforms data area bytes
+ * [offset, offset+len) in place with the current key and direction,
+ * starting from the sqe's IV, and posts a cqe, bumping cq_tail.  Userspace
+ * consumes cqes and bumps cq_head.
+ * len has to be a multiple of the cipher block size.
+ */
+struct __cryptiface_ring_header {
+	__u32 sq_head;		/* written by kernel */
+	__u32 sq_tail;		/* written by user */
+	__u32 cq_head;		/* written by user */
+	__u32 cq_tail;		/* written by kernel */
+	__u32 entries;
+	__u32 sq_offset;
+	__u32 cq_offset;
+	__u32 data_offset;
+	__u32 data_size;
+};
+
+struct __cryptiface_sqe {
+	__u64 user_data;
+	__u32 offset;
+	__u32 len;
+	__u8 iv[CRYPTIFACE_MAX_IV_SIZE];	/* the first IV size bytes */
+};
+
+struct __cryptiface_cqe {
+	__u64 user_data;
+	__s32 res;		/* 0 or -errno */
+	__u32 len;
+};
+
+struct __cryptiface_batch_entry {
+	int context_id;
+	int encrypt;
+	const char *in;
+	/* room for len rounded up to the block size; the same buffer as in
+	 * or not overlapping it */
+	char *out;
+	size_t len;
+	/* only the first IV size bytes are used */
+	unsigned char iv[CRYPTIFACE_MAX_IV_SIZE];
+	long result;		/* filled in: bytes written to out, or -errno */
+};
+
+struct __cryptiface_batch_op {
+	int algorithm;
+	struct __cryptiface_batch_entry *entries;
+	int count;
+};
+
+enum { CRYPTIFACE_MAX_BATCH = 1024 };
+enum { CRYPTIFACE_MAX_BATCH_LEN = 16 << 20 };
+
+/*
+ * CRYPTIFACE_F_PIN_USER: buffers of at least the pin_threshold module
+ * parameter are encrypted straight from (and, for batches, into) pinned
+ * user pages instead of being copied.  write() then returns only once the
+ * data is encrypted.
+ *
+ * CRYPTIFACE_F_COALESCE: read() goes on with the following finished
+ * results while there is room in the buffer, instead of returning after
+ * one.  Results end where the buffer does either way; what does not fit
+ * is left for the next read().
+ *
+ * CRYPTIFACE_F_TAGGED: every write() starts with a __u64 cookie, and read()
+ * returns results in the order they complete, each behind a struct
+ * __cryptiface_tag.  The rest of a result that does not fit comes with the
+ * same cookie in the next read().  splice() into the fd is refused.
+ */
+enum __cryptiface_flags {
+	CRYPTIFACE_F_PIN_USER = 1 << 0,
+	CRYPTIFACE_F_COALESCE = 1 << 1,
+	CRYPTIFACE_F_TAGGED = 1 << 2,
+	CRYPTIFACE_F_ALL = CRYPTIFACE_F_PIN_USER | CRYPTIFACE_F_COALESCE
+		| CRYPTIFACE_F_TAGGED
+};
+
+struct __cryptiface_tag {
+	__u64 cookie;		/* from the write */
+	__s32 status;		/* 0 or a negative errno */
+	__u32 len;		/* bytes of data following */
+};
+
+struct __cryptiface_setflags_op {
+	unsigned int flags;
+};
+
 enum __cryptiface_ioctl_opnrs {
 	CRYPTIFACE_SETCURRENT_NR,
 	CRYPTIFACE_ADDKEY_NR,
 	CRYPTIFACE_DELKEY_NR,
 	CRYPTIFACE_NUMRESULTS_NR,
 	CRYPTIFACE_SIZERESULTS_NR,
+	CRYPTIFACE_RING_SETUP_NR,
+	CRYPTIFACE_RING_ENTER_NR,
+	CRYPTIFACE_BATCH_NR,
+	CRYPTIFACE_SETFLAGS_NR,
+	CRYPTIFACE_SETIV_NR,
+	CRYPTIFACE_RESULTSTAT_NR,
+	CRYPTIFACE_STREAM_NR,
+	CRYPTIFACE_STATS_NR,
 	CRYPTIFACE_INVALID_NR
 };
 
-enum crypto_algorithms { CRYPTIFACE_ALG_DES, CRYPTIFACE_ALG_INVALID };
+/*
+ * AES takes 16, 24 or 32 byte keys, XTS twice that.  Every buffer is a
+ * message of its own, starting from the IV given with it, unless the fd
+ * streams.  CTR and ChaCha20 give the plaintexts away when an IV is used
+ * twice with a key, so writes on them are refused without a SETIV; the
+ * other modes start from an all-zero IV then.
+ */
+enum crypto_algorithms {
+	CRYPTIFACE_ALG_DES,
+	CRYPTIFACE_ALG_AES_ECB,
+	CRYPTIFACE_ALG_AES_CBC,
+	CRYPTIFACE_ALG_AES_CTR,
+	CRYPTIFACE_ALG_AES_XTS,
+	CRYPTIFACE_ALG_CHACHA20,
+	CRYPTIFACE_ALG_INVALID
+};
+
+enum {
+	CRYPTIFACE_STATS_VERSION = 1,
+	CRYPTIFACE_LATENCY_BUCKETS = 32,
+	/* room for algorithms yet to come, so nothing after them moves */
+	CRYPTIFACE_STATS_MAX_ALGORITHMS = 32
+};
+
+/*
+ * An op is one message: a result transformed for an fd, a batch entry or
+ * a ring entry, however many pieces it was split into.  Bytes count all
+ * that went through the cipher, padding included.
+ */
+struct __cryptiface_alg_stats {
+	__u64 encrypt_ops;
+	__u64 encrypt_bytes;
+	__u64 decrypt_ops;
+	__u64 decrypt_bytes;
+};
+
+struct __cryptiface_stats_header {
+	__u32 version;
+	__u32 size;	/* in: room for the struct, out: bytes filled in */
+};
+
+/*
+ * Counters for the whole module, all uids together, filled in by
+ * CRYPTIFACE_IOCTL_STATS up to header.size, which the caller sets to the
+ * size of its struct.  Fields are only ever added at the end, so either
+ * side may be older.  Latency bucket i counts write() or read() calls that
+ * took less than 2^i microseconds and at least half that, the last one
+ * everything longer.
+ */
+struct __cryptiface_stats {
+	struct __cryptiface_stats_header header;
+	/* results waiting to be read on all fds */
+	__u64 queued_results;
+	__u64 queued_bytes;
+	/* the data page pools of all CPUs */
+	__u64 pool_cached;
+	__u64 pool_hits;
+	__u64 pool_misses;
+	__u64 pool_recycled;
+	__u64 pool_released;
+	/* keyed transforms reused by setcurrent and batches, or created */
+	__u64 cipher_cache_hits;
+	__u64 cipher_cache_misses;
+	__u64 write_latency[CRYPTIFACE_LATENCY_BUCKETS];
+	__u64 read_latency[CRYPTIFACE_LATENCY_BUCKETS];
+	/* writers and readers of an fd that found it taken */
+	__u64 write_lock_contended;
+	__u64 read_lock_contended;
+	/* writers that waited for readers to make room */
+	__u64 queue_space_waits;
+	/* indexed by enum crypto_algorithms */
+	struct __cryptiface_alg_stats
+		algorithms[CRYPTIFACE_STATS_MAX_ALGORITHMS];
+};
 
 #define CRYPTIFACE_IOCTL_MAGIC 0xCC
 #define CRYPTIFACE_IOCTL_SETCURRENT _IOW(CRYPTIFACE_IOCTL_MAGIC,        \
@@ -47,4 +258,28 @@ enum crypto_algorithms { CRYPTIFACE_ALG_DES, CRYPTIFACE_ALG_INVALID };
 					CRYPTIFACE_NUMRESULTS_NR)
 #define CRYPTIFACE_IOCTL_SIZERESULTS _IOR(CRYPTIFACE_IOCTL_MAGIC,	\
 					  CRYPTIFACE_SIZERESULTS_NR,	\
-					  struct __cryptiface_sizeresults_op*) 
+					  struct __cryptiface_sizeresults_op*)
+#define CRYPTIFACE_IOCTL_RING_SETUP _IOWR(CRYPTIFACE_IOCTL_MAGIC,	\
+					  CRYPTIFACE_RING_SETUP_NR,	\
+					  struct __cryptiface_ring_setup_op)
+#define CRYPTIFACE_IOCTL_RING_ENTER _IO(CRYPTIFACE_IOCTL_MAGIC,		\
+					CRYPTIFACE_RING_ENTER_NR)
+#define CRYPTIFACE_IOCTL_BATCH _IOW(CRYPTIFACE_IOCTL_MAGIC,		\
+				    CRYPTIFACE_BATCH_NR,		\
+				    struct __cryptiface_batch_op)
+#define CRYPTIFACE_IOCTL_SETFLAGS _IOW(CRYPTIFACE_IOCTL_MAGIC,		\
+				       CRYPTIFACE_SETFLAGS_NR,		\
+				       struct __cryptiface_setflags_op)
+#define CRYPTIFACE_IOCTL_SETIV _IOW(CRYPTIFACE_IOCTL_MAGIC,		\
+				    CRYPTIFACE_SETIV_NR,		\
+				    struct __cryptiface_setiv_op)
+#define CRYPTIFACE_IOCTL_RESULTSTAT _IOR(CRYPTIFACE_IOCTL_MAGIC,	\
+					 CRYPTIFACE_RESULTSTAT_NR,	\
+					 struct __cryptiface_resultstat_op)
+#define CRYPTIFACE_IOCTL_STREAM _IOW(CRYPTIFACE_IOCTL_MAGIC,		\
+				     CRYPTIFACE_STREAM_NR,		\
+				     struct __cryptiface_stream_op)
+/* only the header is fixed, the struct behind it grows */
+#define CRYPTIFACE_IOCTL_STATS _IOWR(CRYPTIFACE_IOCTL_MAGIC,		\
+				     CRYPTIFACE_STATS_NR,		\
+				     struct __cryptiface_stats_header)
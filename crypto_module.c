@@ -2,10 +2,16 @@
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/cdev.h>
+#include <linux/kref.h>
+#include <linux/idr.h>
 #include <linux/crypto.h>
+#include <linux/scatterlist.h>
 
 #include "crypto_structures.h"
 #include "crypto_algorithm.h"
+#include "crypto_pool.h"
+#include "crypto_cipher.h"
+#include "crypto_parallel.h"
 #include "crypto_proc.h"
 #include "crypto_device.h"
 
@@ -14,7 +20,7 @@ MODULE_LICENSE("Dual BSD/GPL");
 
 static bool crypto_api_available(void)
 {
-	return crypto_has_alg("ecb(des)", 0, 0);
+	return probe_crypto_algorithms() > 0;
 }
 
 static int crypto_init(void)
@@ -28,6 +34,16 @@ static int crypto_init(void)
 		return -ENODEV;
 	}
 
+	if((err = create_crypto_pools())) {
+		printk(KERN_WARNING "Couldn't create buffer pools.\n");
+		goto create_pools_fail;
+	}
+
+	if((err = create_crypto_parallel())) {
+		printk(KERN_WARNING "Couldn't create workqueue.\n");
+		goto create_parallel_fail;
+	}
+
 	if((err = create_cryptiface())) {
 		printk(KERN_WARNING "Couldn't create cryptiface device.\n");
 		goto create_cryptiface_fail;
@@ -43,6 +59,10 @@ static int crypto_init(void)
 create_proc_entries_fail:
 	destroy_cryptiface();
 create_cryptiface_fail:
+	destroy_crypto_parallel();
+create_parallel_fail:
+	destroy_crypto_pools();
+create_pools_fail:
 	return err;
 }
 
@@ -50,6 +70,8 @@ static void crypto_exit(void)
 {
 	remove_crypto_proc_entries();
 	destroy_cryptiface();
+	destroy_crypto_parallel();
+	destroy_crypto_pools();
 	printk(KERN_NOTICE "Goodbye, crypto!\n");
 }
 
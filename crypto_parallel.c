@@ -0,0 +1,330 @@
+/* -*- mode: C; fill-column: 80; c-file-style: "linux"; indent-tabs-mode: t  -*- */
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/err.h>
+#include <linux/cpumask.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/crypto.h>
+#include <linux/scatterlist.h>
+
+#include "crypto_algorithm.h"
+#include "crypto_cipher.h"
+#include "crypto_parallel.h"
+
+static unsigned long parallel_threshold = 512 << 10;
+module_param(parallel_threshold, ulong, 0644);
+MODULE_PARM_DESC(parallel_threshold,
+		 "Writes of at least this many bytes are split into pieces");
+
+static unsigned long parallel_chunk = 128 << 10;
+module_param(parallel_chunk, ulong, 0644);
+MODULE_PARM_DESC(parallel_chunk, "Bytes per piece of a split write");
+
+static struct workqueue_struct *parallel_wq;
+
+struct crypto_parallel_job {
+	struct cryptiface_cipher *cipher;
+	bool encrypt;
+	enum crypto_alg_split split;
+	// the message's IV; chained pieces run on it in turn
+	u8 iv[CRYPTO_MAX_IV_LENGTH];
+	// pieces in flight, plus one until all are queued, plus one for a
+	// queued chain_work
+	atomic_t pending;
+	int err;
+	int cpu;
+
+	// pieces queued but not finished, kept at most max_pieces
+	atomic_t pieces;
+	int max_pieces;
+	wait_queue_head_t piece_done;
+
+	// CRYPTO_SPLIT_CHAIN pieces, run one after another by chain_work
+	spinlock_t chain_lock;
+	struct list_head chain;
+	struct work_struct chain_work;
+
+	void (*done)(void *data, int err);
+	void *data;
+};
+
+struct crypto_parallel_piece {
+	struct crypto_parallel_job *job;
+	struct scatterlist *sg;
+	size_t len;
+
+	// independent pieces are submitted from work of their own
+	struct work_struct work;
+	struct ablkcipher_request *req;
+	u8 iv[CRYPTO_MAX_IV_LENGTH];
+
+	struct list_head chain_entry;
+};
+
+int create_crypto_parallel(void)
+{
+	parallel_wq = alloc_workqueue("cryptiface", WQ_CPU_INTENSIVE, 0);
+	if(NULL == parallel_wq) {
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+void destroy_crypto_parallel(void)
+{
+	destroy_workqueue(parallel_wq);
+}
+
+size_t parallel_piece_size(void)
+{
+	return max_t(size_t, parallel_chunk / PAGE_SIZE, 1) * PAGE_SIZE;
+}
+
+bool can_crypt_parallel(struct cryptiface_cipher *cipher, size_t len)
+{
+	enum crypto_alg_split split = get_alg_info(cipher->algorithm)->split;
+	return (split == CRYPTO_SPLIT_BLOCKS || split == CRYPTO_SPLIT_COUNTER)
+		&& len >= parallel_threshold && num_online_cpus() > 1;
+}
+
+bool can_crypt_pipelined(struct cryptiface_cipher *cipher, size_t len)
+{
+	return get_alg_info(cipher->algorithm)->split != CRYPTO_SPLIT_NONE
+		&& len >= parallel_threshold;
+}
+
+// adds blocks to the big endian counter in iv
+static void advance_counter(u8 *iv, unsigned int size, u64 blocks)
+{
+	while(size > 0 && blocks > 0) {
+		size--;
+		blocks += iv[size];
+		iv[size] = blocks & 0xff;
+		blocks >>= 8;
+	}
+}
+
+static void put_parallel_job(struct crypto_parallel_job *job)
+{
+	if(atomic_dec_and_test(&job->pending)) {
+		if(NULL != job->done) {
+			job->done(job->data, job->err);
+		}
+		kfree(job);
+	}
+}
+
+static void finish_parallel_piece(struct crypto_parallel_piece *piece,
+				  int err)
+{
+	struct crypto_parallel_job *job = piece->job;
+	if(err) {
+		// any failed piece fails the whole message
+		job->err = err;
+	}
+	ablkcipher_request_free(piece->req);
+	kfree(piece);
+	atomic_dec(&job->pieces);
+	// the job lives until our put, and so does whoever waits on it
+	wake_up(&job->piece_done);
+	put_parallel_job(job);
+}
+
+static void parallel_piece_done(struct crypto_async_request *req, int err)
+{
+	struct crypto_parallel_piece *piece = req->data;
+	if(err == -EINPROGRESS) {
+		return;
+	}
+	finish_cipher_request(piece->job->cipher, piece->req, err);
+	finish_parallel_piece(piece, err);
+}
+
+static void parallel_piece_work(struct work_struct *work)
+{
+	struct crypto_parallel_piece *piece =
+		container_of(work, struct crypto_parallel_piece, work);
+	struct crypto_parallel_job *job = piece->job;
+	int err;
+
+	err = submit_cipher_request(job->cipher, piece->req, job->encrypt);
+	if(err != -EINPROGRESS) {
+		finish_parallel_piece(piece, err);
+	}
+}
+
+static void parallel_chain_work(struct work_struct *work)
+{
+	struct crypto_parallel_job *job =
+		container_of(work, struct crypto_parallel_job, chain_work);
+	struct crypto_parallel_piece *piece;
+	int err;
+
+	for(;;) {
+		spin_lock(&job->chain_lock);
+		if(list_empty(&job->chain)) {
+			spin_unlock(&job->chain_lock);
+			break;
+		}
+		piece = list_first_entry(&job->chain,
+					 struct crypto_parallel_piece,
+					 chain_entry);
+		list_del(&piece->chain_entry);
+		spin_unlock(&job->chain_lock);
+
+		// leaves the IV the next piece has to start from in job->iv
+		err = cipher_crypt_sync(job->cipher, piece->sg, piece->sg,
+					piece->len, job->iv, job->encrypt);
+		finish_parallel_piece(piece, err);
+	}
+	put_parallel_job(job);
+}
+
+struct crypto_parallel_job* start_parallel_job(
+	struct cryptiface_cipher *cipher, const u8 *iv, bool encrypt,
+	void (*done)(void *data, int err), void *data)
+{
+	struct crypto_parallel_job *job;
+
+	job = kmalloc(sizeof(*job), GFP_KERNEL);
+	if(NULL == job) {
+		return NULL;
+	}
+	job->cipher = cipher;
+	job->encrypt = encrypt;
+	job->split = get_alg_info(cipher->algorithm)->split;
+	memcpy(job->iv, iv, sizeof(job->iv));
+	atomic_set(&job->pending, 1);
+	job->err = 0;
+	job->cpu = raw_smp_processor_id();
+	atomic_set(&job->pieces, 0);
+	// enough to keep every CPU, or the one chain, busy while the next
+	// piece is prepared
+	job->max_pieces = job->split == CRYPTO_SPLIT_CHAIN
+		? 2 : num_online_cpus() + 1;
+	init_waitqueue_head(&job->piece_done);
+	spin_lock_init(&job->chain_lock);
+	INIT_LIST_HEAD(&job->chain);
+	INIT_WORK(&job->chain_work, parallel_chain_work);
+	job->done = done;
+	job->data = data;
+	return job;
+}
+
+static void queue_chained_piece(struct crypto_parallel_job *job,
+				struct crypto_parallel_piece *piece)
+{
+	spin_lock(&job->chain_lock);
+	list_add_tail(&piece->chain_entry, &job->chain);
+	spin_unlock(&job->chain_lock);
+	atomic_inc(&job->pending);
+	if(!queue_work(parallel_wq, &job->chain_work)) {
+		// already queued, it will see the piece
+		atomic_dec(&job->pending);
+	}
+}
+
+static int queue_independent_piece(struct crypto_parallel_job *job,
+				   struct crypto_parallel_piece *piece,
+				   size_t offset)
+{
+	struct crypto_ablkcipher *tfm = job->cipher->tfm;
+
+	piece->req = alloc_cipher_request(job->cipher, parallel_piece_done,
+					  piece);
+	if(NULL == piece->req) {
+		return -ENOMEM;
+	}
+	memcpy(piece->iv, job->iv, sizeof(piece->iv));
+	if(job->split == CRYPTO_SPLIT_COUNTER) {
+		// ctr(aes) reports a block size of 1, but its counter moves
+		// once per IV sized block
+		unsigned int ivsize = crypto_ablkcipher_ivsize(tfm);
+		advance_counter(piece->iv, ivsize, offset / ivsize);
+	}
+	// the walk stops after len bytes, sg needs no end mark there
+	ablkcipher_request_set_crypt(piece->req, piece->sg, piece->sg,
+				     piece->len, piece->iv);
+	INIT_WORK(&piece->work, parallel_piece_work);
+
+	// round robin from the submitting CPU; work queued on a CPU going
+	// offline still runs elsewhere
+	job->cpu = cpumask_next(job->cpu, cpu_online_mask);
+	if(job->cpu >= nr_cpu_ids) {
+		job->cpu = cpumask_first(cpu_online_mask);
+	}
+	queue_work_on(job->cpu, parallel_wq, &piece->work);
+	return 0;
+}
+
+int queue_parallel_piece(struct crypto_parallel_job *job,
+			 struct scatterlist *sg, size_t offset, size_t len)
+{
+	struct crypto_parallel_piece *piece;
+	int err;
+
+	wait_event(job->piece_done,
+		   atomic_read(&job->pieces) < job->max_pieces);
+
+	piece = kmalloc(sizeof(*piece), GFP_KERNEL);
+	if(NULL == piece) {
+		return -ENOMEM;
+	}
+	piece->job = job;
+	piece->sg = sg;
+	piece->len = len;
+	piece->req = NULL;
+	atomic_inc(&job->pieces);
+	atomic_inc(&job->pending);
+	if(job->split == CRYPTO_SPLIT_CHAIN) {
+		queue_chained_piece(job, piece);
+		return 0;
+	}
+	err = queue_independent_piece(job, piece, offset);
+	if(err) {
+		atomic_dec(&job->pieces);
+		atomic_dec(&job->pending);
+		kfree(piece);
+	}
+	return err;
+}
+
+void finish_parallel_job(struct crypto_parallel_job *job, int err)
+{
+	if(err) {
+		job->err = err;
+	}
+	put_parallel_job(job);
+}
+
+void abort_parallel_job(struct crypto_parallel_job *job)
+{
+	wait_event(job->piece_done, atomic_read(&job->pieces) == 0);
+	// a chain_work that is still winding down may free the job
+	job->done = NULL;
+	put_parallel_job(job);
+}
+
+int crypt_parallel(struct cryptiface_cipher *cipher, struct scatterlist *sg,
+		   size_t len, const u8 *iv, bool encrypt,
+		   void (*done)(void *data, int err), void *data)
+{
+	struct crypto_parallel_job *job;
+	size_t piece_len = parallel_piece_size();
+	size_t offset;
+	int err = 0;
+
+	job = start_parallel_job(cipher, iv, encrypt, done, data);
+	if(NULL == job) {
+		return -ENOMEM;
+	}
+	for(offset = 0; offset < len && !err; offset += piece_len) {
+		// pieces already queued still finish if this fails
+		err = queue_parallel_piece(job, &sg[offset / PAGE_SIZE], offset,
+					   min(piece_len, len - offset));
+	}
+	finish_parallel_job(job, err);
+	return -EINPROGRESS;
+}
@@ -0,0 +1,44 @@
+/* -*- mode: C; fill-column: 80; c-file-style: "linux"; indent-tabs-mode: t  -*- */
+
+// #include "crypto_cipher.h"
+
+int create_crypto_parallel(void);
+void destroy_crypto_parallel(void);
+
+// bytes per piece, a multiple of PAGE_SIZE
+size_t parallel_piece_size(void);
+// whether a message of len bytes is worth spreading over CPUs
+bool can_crypt_parallel(struct cryptiface_cipher *cipher, size_t len);
+// whether a message of len bytes may be transformed piece by piece
+bool can_crypt_pipelined(struct cryptiface_cipher *cipher, size_t len);
+
+/*
+ * A job transforms one message in place, piece by piece.  Pieces of
+ * splittable modes run concurrently on different CPUs, those of chained
+ * modes one after another.  Pieces are queued in message order;
+ * queue_parallel_piece() sleeps while too many are unfinished.  sg of a
+ * piece holds one page per entry.
+ *
+ * done(data, err) is called exactly once, after finish_parallel_job() and
+ * the last piece, possibly in softirq context.  The caller keeps the
+ * cipher and the pages alive until then.
+ */
+struct crypto_parallel_job;
+
+struct crypto_parallel_job* start_parallel_job(
+	struct cryptiface_cipher *cipher, const u8 *iv, bool encrypt,
+	void (*done)(void *data, int err), void *data);
+int queue_parallel_piece(struct crypto_parallel_job *job,
+			 struct scatterlist *sg, size_t offset, size_t len);
+// err, if any, fails the message
+void finish_parallel_job(struct crypto_parallel_job *job, int err);
+// instead of finish: waits for the queued pieces, done() is not called
+void abort_parallel_job(struct crypto_parallel_job *job);
+
+/*
+ * Runs a whole message held in sg as one job.  Returns -EINPROGRESS once
+ * done() is guaranteed to be called, or an error.
+ */
+int crypt_parallel(struct cryptiface_cipher *cipher, struct scatterlist *sg,
+		   size_t len, const u8 *iv, bool encrypt,
+		   void (*done)(void *data, int err), void *data);
@@ -0,0 +1,127 @@
+/* -*- mode: C; fill-column: 80; c-file-style: "linux"; indent-tabs-mode: t  -*- */
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/percpu.h>
+#include <linux/gfp.h>
+#include <linux/slab.h>
+#include <linux/scatterlist.h>
+
+#include "crypto_pool.h"
+
+static unsigned int pool_pages = 64;
+module_param(pool_pages, uint, 0644);
+MODULE_PARM_DESC(pool_pages, "Data pages kept for reuse on each CPU");
+
+struct crypto_page_pool {
+	unsigned int count;
+	void *pages[CRYPTO_POOL_MAX_PAGES];
+
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long recycled;
+	unsigned long released;
+};
+
+static DEFINE_PER_CPU(struct crypto_page_pool, page_pools);
+
+static struct kmem_cache *sg_cache;
+
+int create_crypto_pools(void)
+{
+	sg_cache = kmem_cache_create("cryptiface_sg",
+				     CRYPTO_POOL_SG_ENTRIES
+				     * sizeof(struct scatterlist),
+				     0, 0, NULL);
+	if(NULL == sg_cache) {
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+void destroy_crypto_pools(void)
+{
+	int cpu;
+	for_each_possible_cpu(cpu) {
+		struct crypto_page_pool *pool = &per_cpu(page_pools, cpu);
+		while(pool->count > 0) {
+			pool->count--;
+			free_page((unsigned long) pool->pages[pool->count]);
+		}
+	}
+	kmem_cache_destroy(sg_cache);
+}
+
+void* alloc_pool_page(gfp_t gfp)
+{
+	struct crypto_page_pool *pool = &get_cpu_var(page_pools);
+	void *page = NULL;
+	if(pool->count > 0) {
+		pool->count--;
+		page = pool->pages[pool->count];
+		pool->hits++;
+	} else {
+		pool->misses++;
+	}
+	put_cpu_var(page_pools);
+
+	if(NULL == page) {
+		page = (void*) __get_free_page(gfp);
+	}
+	return page;
+}
+
+void free_pool_page(void *page)
+{
+	struct crypto_page_pool *pool = &get_cpu_var(page_pools);
+	unsigned int limit = min(ACCESS_ONCE(pool_pages),
+				 (unsigned int) CRYPTO_POOL_MAX_PAGES);
+	if(pool->count < limit) {
+		pool->pages[pool->count] = page;
+		pool->count++;
+		pool->recycled++;
+		page = NULL;
+	} else {
+		pool->released++;
+	}
+	put_cpu_var(page_pools);
+
+	if(NULL != page) {
+		free_page((unsigned long) page);
+	}
+}
+
+struct scatterlist* alloc_sg_table(int nents, gfp_t gfp)
+{
+	struct scatterlist *sg;
+	if(nents <= CRYPTO_POOL_SG_ENTRIES) {
+		sg = kmem_cache_alloc(sg_cache, gfp);
+	} else {
+		sg = kmalloc(nents*sizeof(*sg), gfp);
+	}
+	if(NULL != sg) {
+		sg_init_table(sg, nents);
+	}
+	return sg;
+}
+
+void free_sg_table(struct scatterlist *sg, int nents)
+{
+	if(NULL == sg) {
+		return;
+	}
+	if(nents <= CRYPTO_POOL_SG_ENTRIES) {
+		kmem_cache_free(sg_cache, sg);
+	} else {
+		kfree(sg);
+	}
+}
+
+void get_crypto_pool_stats(int cpu, struct crypto_pool_stats *stats)
+{
+	struct crypto_page_pool *pool = &per_cpu(page_pools, cpu);
+	stats->cached = ACCESS_ONCE(pool->count);
+	stats->hits = ACCESS_ONCE(pool->hits);
+	stats->misses = ACCESS_ONCE(pool->misses);
+	stats->recycled = ACCESS_ONCE(pool->recycled);
+	stats->released = ACCESS_ONCE(pool->released);
+}
@@ -0,0 +1,28 @@
+/* -*- mode: C; fill-column: 80; c-file-style: "linux"; indent-tabs-mode: t  -*- */
+
+// upper bound for the pool_pages module parameter
+enum { CRYPTO_POOL_MAX_PAGES = 256 };
+// sg tables up to this many entries come from a dedicated cache
+enum { CRYPTO_POOL_SG_ENTRIES = 16 };
+
+struct crypto_pool_stats {
+	unsigned int cached;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long recycled;
+	unsigned long released;
+};
+
+int create_crypto_pools(void);
+void destroy_crypto_pools(void);
+
+/*
+ * Pages and sg tables may only be allocated and freed from process
+ * context.  Pooled pages hold stale data; callers overwrite all of it.
+ */
+void* alloc_pool_page(gfp_t gfp);
+void free_pool_page(void *page);
+struct scatterlist* alloc_sg_table(int nents, gfp_t gfp);
+void free_sg_table(struct scatterlist *sg, int nents);
+
+void get_crypto_pool_stats(int cpu, struct crypto_pool_stats *stats);
@@ -4,81 +4,82 @@
 #include <linux/seq_file.h>
 #include <linux/sched.h>
 #include <linux/cdev.h>
+#include <linux/kref.h>
+#include <linux/idr.h>
 #include <asm/uaccess.h>
 
 #include "crypto_structures.h"
+#include "crypto_ioctlmagic.h"
 #include "crypto_algorithm.h"
+#include "crypto_cipher.h"
 #include "crypto_device.h"
+#include "crypto_pool.h"
 #include "crypto_proc.h"
 
-static void* proc_overview_seq_start(struct seq_file *s, loff_t *pos)
+/*
+ * Iterates over the contexts of the db found at open by id; *pos is the id
+ * of the one shown last.  Every context handed to show() holds a
+ * reference, dropped by next() or stop().
+ */
+static void* proc_overview_context(struct seq_file *s, loff_t *pos)
 {
-	struct crypto_db *db;
-
-	if(*pos >= CRYPTO_MAX_CONTEXT_COUNT) {
-		return NULL;
-	}
+	struct crypto_db *db = s->private;
+	struct crypto_context *context;
+	int id;
 
-	if(mutex_lock_interruptible(&get_cryptodev()->crypto_dbs_mutex)) {
+	if(NULL == db || *pos >= CRYPTO_MAX_CONTEXT_COUNT) {
 		return NULL;
 	}
-	db = get_or_create_crypto_db(&get_cryptodev()->crypto_dbs,
-				     current_euid());
-	mutex_unlock(&get_cryptodev()->crypto_dbs_mutex);
-	if(NULL == db) {
-		return NULL;
+	id = *pos;
+	context = get_next_context(db, &id);
+	if(NULL != context) {
+		*pos = id;
 	}
-	return &db->contexts[*pos];
+	return context;
 }
 
-static void* proc_overview_seq_next(struct seq_file *s, void *v, loff_t *pos)
+static void* proc_overview_seq_start(struct seq_file *s, loff_t *pos)
 {
-	struct crypto_db *db;
+	return proc_overview_context(s, pos);
+}
 
+static void* proc_overview_seq_next(struct seq_file *s, void *v, loff_t *pos)
+{
+	put_context(v);
 	(*pos)++;
-	if(*pos >= CRYPTO_MAX_CONTEXT_COUNT) {
-		return NULL;
-	}
+	return proc_overview_context(s, pos);
+}
 
-	if(mutex_lock_interruptible(&get_cryptodev()->crypto_dbs_mutex)) {
-		return NULL;
-	}
-	db = get_or_create_crypto_db(&get_cryptodev()->crypto_dbs,
-				     current_euid());
-	mutex_unlock(&get_cryptodev()->crypto_dbs_mutex);
-	if(NULL == db) {
-		return NULL;
+static void proc_overview_seq_stop(struct seq_file *s, void *v)
+{
+	if(NULL != v) {
+		put_context(v);
 	}
-	return &db->contexts[*pos];
 }
 
-static void proc_overview_seq_stop(struct seq_file *s, void *v) {}
-
 static int proc_overview_seq_show(struct seq_file *s, void *v) {
-	struct crypto_db *db;
 	struct crypto_context *context;
-	size_t ix;
+	struct cryptiface_cipher_stats stats = {0};
+	bool is_active;
 
 	if(v == NULL) {
 		return -EINVAL;
 	}
 
-	if(mutex_lock_interruptible(&get_cryptodev()->crypto_dbs_mutex)) {
-		return -ERESTARTSYS;
-	}
-	db = get_or_create_crypto_db(&get_cryptodev()->crypto_dbs,
-				     current_euid());
-	mutex_unlock(&get_cryptodev()->crypto_dbs_mutex);
-	if(NULL == db) {
-		return -ENOMEM;
-	}
-
 	context = v;
-	ix = context - db->contexts;
-	if(context->is_active) {
-		seq_printf(s, "%zd\tdes\t%ld\t%ld\t%ld\n",
-			   ix, context->added_time,
-			   context->encoded_count, context->decoded_count);
+	mutex_lock(&context->context_mutex);
+	is_active = context->is_active;
+	if(NULL != context->cipher) {
+		get_cryptiface_cipher_stats(context->cipher, &stats);
+	}
+	mutex_unlock(&context->context_mutex);
+	if(is_active) {
+		// id, algorithm, added, encrypted and decrypted ops and bytes
+		seq_printf(s, "%d\t%s\t%ld\t%lu\t%lu\t%lu\t%lu\n",
+			   context->id, get_alg_info(context->algorithm)->name,
+			   context->added_time,
+			   stats.encrypt_ops, stats.decrypt_ops,
+			   stats.encrypt_bytes, stats.decrypt_bytes);
 	}
 
 	return 0;
@@ -93,7 +94,15 @@ static struct seq_operations proc_overview_seq_ops = {
 
 static int proc_overview_open(struct inode *inode, struct file *file)
 {
-	return seq_open(file, &proc_overview_seq_ops);
+	int err = seq_open(file, &proc_overview_seq_ops);
+	if(err) {
+		return err;
+	}
+	// Looked up once, dbs live until module exit.  A uid that never
+	// added a key has nothing to show and gets no db from reading.
+	((struct seq_file *) file->private_data)->private =
+		find_crypto_db(get_cryptodev(), current_euid());
+	return 0;
 }
 
 
@@ -105,7 +114,35 @@ static struct file_operations proc_overview_file_ops = {
 	.release = seq_release
 };
 
-static int proc_des_read(char *buffer, char **start, off_t offset, int count,
+static int proc_pool_show(struct seq_file *s, void *v)
+{
+	struct crypto_pool_stats stats;
+	int cpu;
+
+	seq_printf(s, "cpu\tcached\thits\tmisses\trecycled\treleased\n");
+	for_each_online_cpu(cpu) {
+		get_crypto_pool_stats(cpu, &stats);
+		seq_printf(s, "%d\t%u\t%lu\t%lu\t%lu\t%lu\n", cpu,
+			   stats.cached, stats.hits, stats.misses,
+			   stats.recycled, stats.released);
+	}
+	return 0;
+}
+
+static int proc_pool_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, proc_pool_show, NULL);
+}
+
+static struct file_operations proc_pool_file_ops = {
+	.owner = THIS_MODULE,
+	.open = proc_pool_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release
+};
+
+static int proc_key_read(char *buffer, char **start, off_t offset, int count,
 			 int *eof, void *data)
 {
 	int result, written;
@@ -122,12 +159,7 @@ static int proc_des_read(char *buffer, char **start, off_t offset, int count,
 		return -EINVAL;
 	}
 
-	if(mutex_lock_interruptible(&get_cryptodev()->crypto_dbs_mutex)) {
-		return -ERESTARTSYS;
-	}
-	db = get_or_create_crypto_db(&get_cryptodev()->crypto_dbs,
-				     current_euid());
-	mutex_unlock(&get_cryptodev()->crypto_dbs_mutex);
+	db = get_or_create_crypto_db(get_cryptodev(), current_euid());
 	if(NULL == db) {
 		result = -ENOMEM;
 		goto out;
@@ -158,9 +190,11 @@ out:
 	return result;
 }
 
-static int proc_des_write(struct file *file, const char __user *buffer,
+// data is the algorithm the file was created for
+static int proc_key_write(struct file *file, const char __user *buffer,
 			  unsigned long count, void *data)
 {
+	int algorithm = (long) data;
 	if(count < 2) {
 		printk(KERN_WARNING "Call to write() with too little bytes");
 		return -EINVAL;
@@ -179,8 +213,7 @@ static int proc_des_write(struct file *file, const char __user *buffer,
 			return -EFAULT;
 		}
 
-		db = get_or_create_crypto_db(
-			&get_cryptodev()->crypto_dbs, current_euid());
+		db = get_or_create_crypto_db(get_cryptodev(), current_euid());
 		if(NULL == db) {
 			printk(KERN_WARNING "get_or_create_crypto_db failed\n");
 			return -ENOMEM;
@@ -188,20 +221,14 @@ static int proc_des_write(struct file *file, const char __user *buffer,
 
 		switch(tmp_buffer[0]) {
 		case 'A':
-			if(!is_valid_key(tmp_buffer+1, count-1)) {
+			if(!is_valid_key(algorithm, tmp_buffer+1, count-1)) {
 				printk(KERN_WARNING "invalid key\n");
 				return -EINVAL;
 			}
-			ix = acquire_free_context_index(db);
+			ix = add_key_to_db(db, algorithm, tmp_buffer+1,
+					   count-1);
 			if(ix < 0) {
 				return ix;
-			} else {
-				err = add_key_to_db(db, ix, tmp_buffer+1,
-						    count-1);
-				release_context_index(db, ix);
-				if(err) {
-					return err;
-				}
 			}
 			break;
 		case 'D':
@@ -211,9 +238,7 @@ static int proc_des_write(struct file *file, const char __user *buffer,
 				printk(KERN_WARNING "invalid index\n");
 				return -EINVAL;
 			}
-			acquire_context_index(db, ix);
 			err = delete_key_from_db(db, ix);
-			release_context_index(db, ix);
 			if(err) {
 				return err;
 			}
@@ -229,8 +254,45 @@ static int proc_des_write(struct file *file, const char __user *buffer,
 
 static struct proc_dir_entry *proc_cryptiface_directory = NULL;
 static struct proc_dir_entry *proc_cryptiface_overview = NULL;
-// TODO: refactor to support multiple algorithms.
-static struct proc_dir_entry *proc_cryptiface_des = NULL;
+static struct proc_dir_entry *proc_cryptiface_pool = NULL;
+// one file per algorithm, NULL for those the kernel does not provide
+static struct proc_dir_entry *proc_cryptiface_keys[CRYPTIFACE_ALG_INVALID];
+
+static void remove_proc_key_entries(void)
+{
+	int i;
+	for(i = 0; i<CRYPTIFACE_ALG_INVALID; i++) {
+		if(NULL != proc_cryptiface_keys[i]) {
+			remove_proc_entry(get_alg_info(i)->name,
+					  proc_cryptiface_directory);
+			proc_cryptiface_keys[i] = NULL;
+		}
+	}
+}
+
+static int create_proc_key_entries(void)
+{
+	const struct crypto_algorithm_info *info;
+	int i;
+	for(i = 0; i<CRYPTIFACE_ALG_INVALID; i++) {
+		info = get_alg_info(i);
+		if(NULL == info) {
+			continue;
+		}
+		proc_cryptiface_keys[i] = create_proc_entry(
+			info->name, 0666, proc_cryptiface_directory);
+		if(NULL == proc_cryptiface_keys[i]) {
+			printk(KERN_WARNING "Couldn't create proc '%s' file.\n",
+			       info->name);
+			remove_proc_key_entries();
+			return -EIO;
+		}
+		proc_cryptiface_keys[i]->data = (void *) (long) i;
+		proc_cryptiface_keys[i]->read_proc = proc_key_read;
+		proc_cryptiface_keys[i]->write_proc = proc_key_write;
+	}
+	return 0;
+}
 
 int create_crypto_proc_entries(void)
 {
@@ -251,19 +313,25 @@ int create_crypto_proc_entries(void)
 	}
 	proc_cryptiface_overview->proc_fops = &proc_overview_file_ops;
 
-	proc_cryptiface_des = create_proc_entry("des", 0666,
-						proc_cryptiface_directory);
-	if(NULL == proc_cryptiface_des) {
-		printk(KERN_WARNING "Couldn't create proc 'des' file.\n");
+	proc_cryptiface_pool = create_proc_entry("pool", 0444,
+						 proc_cryptiface_directory);
+	if(NULL == proc_cryptiface_pool) {
+		printk(KERN_WARNING "Couldn't create proc 'pool' file.\n");
 		err = -EIO;
-		goto des_fail;
+		goto pool_fail;
+	}
+	proc_cryptiface_pool->proc_fops = &proc_pool_file_ops;
+
+	if((err = create_proc_key_entries())) {
+		goto keys_fail;
 	}
-	proc_cryptiface_des->read_proc = proc_des_read;
-	proc_cryptiface_des->write_proc = proc_des_write;
 
 	return 0;
 
-des_fail:
+keys_fail:
+	remove_proc_entry("pool", proc_cryptiface_directory);
+	proc_cryptiface_pool = NULL;
+pool_fail:
 	remove_proc_entry("overview", proc_cryptiface_directory);
 	proc_cryptiface_overview = NULL;
 overview_fail:
@@ -275,8 +343,9 @@ fail:
 
 void remove_crypto_proc_entries(void)
 {
-	remove_proc_entry("des", proc_cryptiface_directory);
-	proc_cryptiface_des = NULL;
+	remove_proc_key_entries();
+	remove_proc_entry("pool", proc_cryptiface_directory);
+	proc_cryptiface_pool = NULL;
 	remove_proc_entry("overview", proc_cryptiface_directory);
 	proc_cryptiface_overview = NULL;
 	remove_proc_entry("cryptiface", NULL);
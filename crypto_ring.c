@@ -0,0 +1,267 @@
+/* -*- mode: C; fill-column: 80; c-file-style: "linux"; indent-tabs-mode: t  -*- */
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include <linux/kref.h>
+#include <linux/completion.h>
+#include <linux/crypto.h>
+#include <linux/scatterlist.h>
+
+#include "crypto_ioctlmagic.h"
+#include "crypto_cipher.h"
+#include "crypto_pool.h"
+#include "crypto_ring.h"
+
+struct crypto_ring_op {
+	struct cryptiface_ring *ring;
+	struct cryptiface_cipher *cipher;
+	struct ablkcipher_request *req;
+	struct scatterlist *sg;
+	int sg_len;
+	__u64 user_data;
+	__u32 len;
+	int res;
+	u8 iv[CRYPTO_MAX_IV_LENGTH];
+};
+
+struct cryptiface_ring {
+	void *mem;
+	size_t mem_size;
+
+	// The header lives in memory shared with userspace, so the indices
+	// the kernel owns are kept here and only published to the header.
+	struct __cryptiface_ring_header *header;
+	struct __cryptiface_sqe *sqes;
+	struct __cryptiface_cqe *cqes;
+	char *data;
+	unsigned int entries;
+	size_t data_size;
+	unsigned int sq_head;
+	unsigned int cq_tail;
+
+	struct mutex enter_mutex;
+	// operations of the current batch still owned by the cipher
+	atomic_t pending;
+	struct completion batch_done;
+	struct crypto_ring_op ops[CRYPTO_RING_BATCH];
+};
+
+struct cryptiface_ring* create_crypto_ring(unsigned int entries,
+					   size_t data_size)
+{
+	struct cryptiface_ring *ring;
+	size_t sq_offset, cq_offset, data_offset;
+
+	if(entries == 0 || entries > CRYPTO_RING_MAX_ENTRIES
+	   || (entries & (entries-1)) != 0) {
+		printk(KERN_DEBUG "invalid ring size: %u\n", entries);
+		return ERR_PTR(-EINVAL);
+	}
+	if(data_size == 0 || data_size > CRYPTO_RING_MAX_DATA_SIZE) {
+		printk(KERN_DEBUG "invalid ring data size: %zd\n", data_size);
+		return ERR_PTR(-EINVAL);
+	}
+
+	ring = kmalloc(sizeof(*ring), GFP_KERNEL);
+	if(NULL == ring) {
+		return ERR_PTR(-ENOMEM);
+	}
+
+	sq_offset = ALIGN(sizeof(struct __cryptiface_ring_header),
+			  sizeof(__u64));
+	cq_offset = sq_offset + entries*sizeof(struct __cryptiface_sqe);
+	data_offset = PAGE_ALIGN(cq_offset
+				 + entries*sizeof(struct __cryptiface_cqe));
+	data_size = PAGE_ALIGN(data_size);
+
+	ring->mem_size = data_offset + data_size;
+	ring->mem = vmalloc_user(ring->mem_size);
+	if(NULL == ring->mem) {
+		kfree(ring);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	ring->header = ring->mem;
+	ring->sqes = ring->mem + sq_offset;
+	ring->cqes = ring->mem + cq_offset;
+	ring->data = ring->mem + data_offset;
+	ring->entries = entries;
+	ring->data_size = data_size;
+	ring->sq_head = 0;
+	ring->cq_tail = 0;
+	mutex_init(&ring->enter_mutex);
+
+	ring->header->entries = entries;
+	ring->header->sq_offset = sq_offset;
+	ring->header->cq_offset = cq_offset;
+	ring->header->data_offset = data_offset;
+	ring->header->data_size = data_size;
+	return ring;
+}
+
+void destroy_crypto_ring(struct cryptiface_ring *ring)
+{
+	vfree(ring->mem);
+	kfree(ring);
+}
+
+size_t crypto_ring_mmap_size(struct cryptiface_ring *ring)
+{
+	return ring->mem_size;
+}
+
+int crypto_ring_mmap(struct cryptiface_ring *ring, struct vm_area_struct *vma)
+{
+	if(vma->vm_pgoff != 0
+	   || vma->vm_end - vma->vm_start > ring->mem_size) {
+		return -EINVAL;
+	}
+	return remap_vmalloc_range(vma, ring->mem, 0);
+}
+
+static void crypto_ring_op_done(struct crypto_async_request *req, int err)
+{
+	struct crypto_ring_op *op = req->data;
+	if(err == -EINPROGRESS) {
+		return;
+	}
+	finish_cipher_request(op->cipher, op->req, err);
+	op->res = err;
+	if(atomic_dec_and_test(&op->ring->pending)) {
+		complete(&op->ring->batch_done);
+	}
+}
+
+static int crypto_ring_build_sg(struct cryptiface_ring *ring,
+				struct crypto_ring_op *op,
+				size_t offset, size_t len)
+{
+	size_t remaining = len;
+	int nents, i;
+
+	if(len == 0 || len > ring->data_size
+	   || offset > ring->data_size - len) {
+		return -EINVAL;
+	}
+
+	nents = (offset_in_page(offset) + len + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	op->sg = alloc_sg_table(nents, GFP_KERNEL);
+	if(NULL == op->sg) {
+		return -ENOMEM;
+	}
+	op->sg_len = nents;
+	for(i = 0; i<nents; i++) {
+		char *addr = ring->data + offset;
+		size_t chunk = min(remaining,
+				   (size_t) (PAGE_SIZE - offset_in_page(addr)));
+		sg_set_page(&op->sg[i], vmalloc_to_page(addr), chunk,
+			    offset_in_page(addr));
+		offset += chunk;
+		remaining -= chunk;
+	}
+	return 0;
+}
+
+static void crypto_ring_submit(struct cryptiface_ring *ring,
+			       struct cryptiface_cipher *cipher, bool encrypt,
+			       struct crypto_ring_op *op, size_t offset)
+{
+	int err;
+
+	op->ring = ring;
+	op->cipher = cipher;
+	op->sg = NULL;
+	op->req = NULL;
+	if(op->len % crypto_ablkcipher_blocksize(cipher->tfm) != 0) {
+		op->res = -EINVAL;
+		return;
+	}
+	op->res = crypto_ring_build_sg(ring, op, offset, op->len);
+	if(op->res) {
+		return;
+	}
+	op->req = alloc_cipher_request(cipher, crypto_ring_op_done, op);
+	if(NULL == op->req) {
+		op->res = -ENOMEM;
+		return;
+	}
+	ablkcipher_request_set_crypt(op->req, op->sg, op->sg, op->len, op->iv);
+
+	atomic_inc(&ring->pending);
+	err = submit_cipher_request(cipher, op->req, encrypt);
+	if(err != -EINPROGRESS) {
+		op->res = err;
+		atomic_dec(&ring->pending);
+	}
+}
+
+int crypto_ring_enter(struct cryptiface_ring *ring,
+		      struct cryptiface_cipher *cipher, bool encrypt)
+{
+	struct __cryptiface_ring_header *header = ring->header;
+	unsigned int mask = ring->entries - 1;
+	unsigned int sq_tail;
+	int processed = 0;
+	int i, count;
+
+	if(mutex_lock_interruptible(&ring->enter_mutex)) {
+		return -ERESTARTSYS;
+	}
+	sq_tail = ACCESS_ONCE(header->sq_tail);
+	// read sqes only after seeing the tail that published them
+	smp_rmb();
+	do {
+		unsigned int cq_used = ring->cq_tail
+			- ACCESS_ONCE(header->cq_head);
+		unsigned int cq_free = cq_used < ring->entries
+			? ring->entries - cq_used : 0;
+
+		// Submit a batch, bounded by free completion slots, and let
+		// the cipher work on all of it before posting completions
+		// in submission order.
+		atomic_set(&ring->pending, 1);
+		init_completion(&ring->batch_done);
+		for(count = 0; count < CRYPTO_RING_BATCH
+			    && count < cq_free
+			    && processed + count < ring->entries
+			    && ring->sq_head + count != sq_tail; count++) {
+			struct __cryptiface_sqe *sqe =
+				&ring->sqes[(ring->sq_head + count) & mask];
+			struct crypto_ring_op *op = &ring->ops[count];
+			op->user_data = ACCESS_ONCE(sqe->user_data);
+			op->len = ACCESS_ONCE(sqe->len);
+			// the cipher must not see it change under its feet
+			memcpy(op->iv, sqe->iv, sizeof(op->iv));
+			crypto_ring_submit(ring, cipher, encrypt, op,
+					   ACCESS_ONCE(sqe->offset));
+		}
+		if(!atomic_dec_and_test(&ring->pending)) {
+			wait_for_completion(&ring->batch_done);
+		}
+
+		for(i = 0; i<count; i++) {
+			struct crypto_ring_op *op = &ring->ops[i];
+			struct __cryptiface_cqe *cqe =
+				&ring->cqes[ring->cq_tail & mask];
+			cqe->user_data = op->user_data;
+			cqe->res = op->res;
+			cqe->len = op->len;
+			if(op->res == 0) {
+				count_cipher_op(cipher, encrypt);
+			}
+			if(NULL != op->req) {
+				ablkcipher_request_free(op->req);
+			}
+			free_sg_table(op->sg, op->sg_len);
+			ring->sq_head++;
+			ring->cq_tail++;
+		}
+		processed += count;
+	} while(count > 0);
+	// publish cqes before the tail that exposes them
+	smp_wmb();
+	header->cq_tail = ring->cq_tail;
+	header->sq_head = ring->sq_head;
+	mutex_unlock(&ring->enter_mutex);
+	return processed;
+}
@@ -0,0 +1,19 @@
+/* -*- mode: C; fill-column: 80; c-file-style: "linux"; indent-tabs-mode: t  -*- */
+
+// #include "crypto_ioctlmagic.h"
+// #include "crypto_cipher.h"
+
+enum { CRYPTO_RING_MAX_ENTRIES = 4096 };
+enum { CRYPTO_RING_MAX_DATA_SIZE = 64 << 20 };
+// operations kept in flight at once by one RING_ENTER
+enum { CRYPTO_RING_BATCH = 64 };
+
+struct cryptiface_ring;
+
+struct cryptiface_ring* create_crypto_ring(unsigned int entries,
+					   size_t data_size);
+void destroy_crypto_ring(struct cryptiface_ring *ring);
+size_t crypto_ring_mmap_size(struct cryptiface_ring *ring);
+int crypto_ring_mmap(struct cryptiface_ring *ring, struct vm_area_struct *vma);
+int crypto_ring_enter(struct cryptiface_ring *ring,
+		      struct cryptiface_cipher *cipher, bool encrypt);
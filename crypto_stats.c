@@ -0,0 +1,104 @@
+/* -*- mode: C; fill-column: 80; c-file-style: "linux"; indent-tabs-mode: t  -*- */
+#include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/cdev.h>
+#include <linux/kref.h>
+#include <linux/idr.h>
+#include <linux/string.h>
+#include <linux/bug.h>
+
+#include "crypto_structures.h"
+#include "crypto_ioctlmagic.h"
+#include "crypto_algorithm.h"
+#include "crypto_device.h"
+#include "crypto_pool.h"
+#include "crypto_stats.h"
+
+struct crypto_stats {
+	struct __cryptiface_alg_stats algorithms[CRYPTIFACE_ALG_INVALID];
+	u64 events[CRYPTO_STAT_EVENTS];
+	u64 latency[CRYPTO_STAT_LATENCIES][CRYPTIFACE_LATENCY_BUCKETS];
+};
+
+static DEFINE_PER_CPU(struct crypto_stats, crypto_stats);
+
+void crypto_stats_count_op(int algorithm, bool encrypt)
+{
+	if(encrypt) {
+		this_cpu_inc(crypto_stats.algorithms[algorithm].encrypt_ops);
+	} else {
+		this_cpu_inc(crypto_stats.algorithms[algorithm].decrypt_ops);
+	}
+}
+
+void crypto_stats_count_bytes(int algorithm, bool encrypt, size_t len)
+{
+	if(encrypt) {
+		this_cpu_add(crypto_stats.algorithms[algorithm].encrypt_bytes,
+			     len);
+	} else {
+		this_cpu_add(crypto_stats.algorithms[algorithm].decrypt_bytes,
+			     len);
+	}
+}
+
+void crypto_stats_count_event(enum crypto_stat_event event)
+{
+	this_cpu_inc(crypto_stats.events[event]);
+}
+
+// bucket i holds calls shorter than 2^i microseconds, give or take
+void crypto_stats_record_latency(enum crypto_stat_latency which, u64 ns)
+{
+	int bucket = min(fls64(ns >> 10), CRYPTIFACE_LATENCY_BUCKETS - 1);
+	this_cpu_inc(crypto_stats.latency[which][bucket]);
+}
+
+void get_crypto_stats(struct __cryptiface_stats *stats)
+{
+	struct crypto_pool_stats pool;
+	int cpu, i;
+
+	BUILD_BUG_ON(CRYPTIFACE_ALG_INVALID > CRYPTIFACE_STATS_MAX_ALGORITHMS);
+	memset(stats, 0, sizeof(*stats));
+	stats->header.version = CRYPTIFACE_STATS_VERSION;
+	stats->header.size = sizeof(*stats);
+	for_each_possible_cpu(cpu) {
+		struct crypto_stats *cpu_stats = &per_cpu(crypto_stats, cpu);
+		for(i = 0; i<CRYPTIFACE_ALG_INVALID; i++) {
+			struct __cryptiface_alg_stats *alg =
+				&cpu_stats->algorithms[i];
+			stats->algorithms[i].encrypt_ops += alg->encrypt_ops;
+			stats->algorithms[i].encrypt_bytes +=
+				alg->encrypt_bytes;
+			stats->algorithms[i].decrypt_ops += alg->decrypt_ops;
+			stats->algorithms[i].decrypt_bytes +=
+				alg->decrypt_bytes;
+		}
+		for(i = 0; i<CRYPTIFACE_LATENCY_BUCKETS; i++) {
+			stats->write_latency[i] +=
+				cpu_stats->latency[CRYPTO_STAT_WRITE][i];
+			stats->read_latency[i] +=
+				cpu_stats->latency[CRYPTO_STAT_READ][i];
+		}
+		stats->cipher_cache_hits +=
+			cpu_stats->events[CRYPTO_STAT_CIPHER_CACHE_HIT];
+		stats->cipher_cache_misses +=
+			cpu_stats->events[CRYPTO_STAT_CIPHER_CACHE_MISS];
+		stats->write_lock_contended +=
+			cpu_stats->events[CRYPTO_STAT_WRITE_LOCK_CONTENDED];
+		stats->read_lock_contended +=
+			cpu_stats->events[CRYPTO_STAT_READ_LOCK_CONTENDED];
+		stats->queue_space_waits +=
+			cpu_stats->events[CRYPTO_STAT_QUEUE_SPACE_WAIT];
+
+		get_crypto_pool_stats(cpu, &pool);
+		stats->pool_cached += pool.cached;
+		stats->pool_hits += pool.hits;
+		stats->pool_misses += pool.misses;
+		stats->pool_recycled += pool.recycled;
+		stats->pool_released += pool.released;
+	}
+	get_crypto_queue_totals(get_cryptodev(), &stats->queued_results,
+				&stats->queued_bytes);
+}
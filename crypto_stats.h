@@ -0,0 +1,31 @@
+/* -*- mode: C; fill-column: 80; c-file-style: "linux"; indent-tabs-mode: t  -*- */
+
+// #include "crypto_ioctlmagic.h"
+
+enum crypto_stat_event {
+	CRYPTO_STAT_CIPHER_CACHE_HIT,
+	CRYPTO_STAT_CIPHER_CACHE_MISS,
+	CRYPTO_STAT_WRITE_LOCK_CONTENDED,
+	CRYPTO_STAT_READ_LOCK_CONTENDED,
+	CRYPTO_STAT_QUEUE_SPACE_WAIT,
+	CRYPTO_STAT_EVENTS
+};
+
+enum crypto_stat_latency {
+	CRYPTO_STAT_WRITE,
+	CRYPTO_STAT_READ,
+	CRYPTO_STAT_LATENCIES
+};
+
+/*
+ * Module wide counters, kept per CPU and summed only when read.  All of
+ * these may be called from any context.
+ */
+// once per message, see count_cipher_op()
+void crypto_stats_count_op(int algorithm, bool encrypt);
+// once per request handed to the cipher
+void crypto_stats_count_bytes(int algorithm, bool encrypt, size_t len);
+void crypto_stats_count_event(enum crypto_stat_event event);
+void crypto_stats_record_latency(enum crypto_stat_latency which, u64 ns);
+
+void get_crypto_stats(struct __cryptiface_stats *stats);
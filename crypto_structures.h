@@ -2,28 +2,42 @@
 
 // #include <linux/cdev.h>
 
+enum { CRYPTO_DB_HASH_BITS = 6 };
+enum { CRYPTO_DB_HASH_SIZE = 1 << CRYPTO_DB_HASH_BITS };
+
 struct cryptodev_t {
 	dev_t dev;
 	struct cdev cdev;
 	struct device *device;
-	struct list_head crypto_dbs;
+	// per-uid dbs hashed by uid.  Lookups walk a bucket under RCU, adding
+	// a db takes crypto_dbs_mutex.  dbs are only freed at module exit.
+	struct list_head crypto_dbs[CRYPTO_DB_HASH_SIZE];
 	struct mutex crypto_dbs_mutex;
 };
 
 
-enum { CRYPTO_MAX_CONTEXT_COUNT = 128 };
-enum { CRYPTO_MAX_KEY_LENGTH = 8 };
+// upper bound on context ids, per uid
+enum { CRYPTO_MAX_CONTEXT_COUNT = 1 << 20 };
+enum { CRYPTO_MAX_KEY_LENGTH = 64 };
+
 
+struct cryptiface_cipher;
 
 struct crypto_context {
+	int id;
+	// cleared under context_mutex when the key is deleted
 	bool is_active;
+	int algorithm;
 	char key[CRYPTO_MAX_KEY_LENGTH];
 	int key_len;
 	unsigned long added_time;
-	unsigned long encoded_count;
-	unsigned long decoded_count;
+	// keyed transform for the key's algorithm, created on first use,
+	// owns one reference; also where the key's usage is counted
+	struct cryptiface_cipher *cipher;
 
 	struct mutex context_mutex;
+	// one held by the db's idr while the key exists, one by each user
+	struct kref ref;
 };
 
 struct new_context_info {
@@ -33,11 +47,20 @@ struct new_context_info {
 
 struct crypto_db {
 	uid_t uid;
-	struct crypto_context contexts[CRYPTO_MAX_CONTEXT_COUNT];
+	// context id -> struct crypto_context, changed under contexts_lock
+	struct idr contexts;
+	spinlock_t contexts_lock;
 	struct list_head db_list;
 
 	struct mutex new_context_wait_mutex;
 	wait_queue_head_t new_context_created_waitqueue;
 	spinlock_t new_contexts_list_lock;
 	struct list_head new_contexts_queue;
+
+	// results queued on all fds of the uid, counted under
+	// queue_space_lock along with those of each fd
+	spinlock_t queue_space_lock;
+	size_t queued_bytes;
+	unsigned int queued_results;
+	wait_queue_head_t queue_space_waitqueue;
 };
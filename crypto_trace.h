@@ -0,0 +1,116 @@
+/* -*- mode: C; fill-column: 80; c-file-style: "linux"; indent-tabs-mode: t  -*- */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM cryptiface
+
+// read more than once by the tracing macros, hence the guard
+#if !defined(_CRYPTO_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _CRYPTO_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * The life of a write: submit once it holds its place in the queue,
+ * alloc_pages for its data, enqueue, cipher_start and cipher_finish around
+ * every request handed to the crypto API, dequeue once it is read.  Batch,
+ * ring and stream requests get cipher_start and cipher_finish as well.
+ * context_id is -1 for a cipher no context owns.
+ */
+DECLARE_EVENT_CLASS(cryptiface_data,
+	TP_PROTO(int context_id, int algorithm, size_t len),
+	TP_ARGS(context_id, algorithm, len),
+	TP_STRUCT__entry(
+		__field(int, context_id)
+		__field(int, algorithm)
+		__field(size_t, len)
+	),
+	TP_fast_assign(
+		__entry->context_id = context_id;
+		__entry->algorithm = algorithm;
+		__entry->len = len;
+	),
+	TP_printk("context=%d algorithm=%d len=%zu", __entry->context_id,
+		  __entry->algorithm, __entry->len)
+);
+
+DEFINE_EVENT(cryptiface_data, cryptiface_submit,
+	TP_PROTO(int context_id, int algorithm, size_t len),
+	TP_ARGS(context_id, algorithm, len)
+);
+
+DEFINE_EVENT(cryptiface_data, cryptiface_enqueue,
+	TP_PROTO(int context_id, int algorithm, size_t len),
+	TP_ARGS(context_id, algorithm, len)
+);
+
+DEFINE_EVENT(cryptiface_data, cryptiface_dequeue,
+	TP_PROTO(int context_id, int algorithm, size_t len),
+	TP_ARGS(context_id, algorithm, len)
+);
+
+TRACE_EVENT(cryptiface_alloc_pages,
+	TP_PROTO(int context_id, int algorithm, size_t len, int nents),
+	TP_ARGS(context_id, algorithm, len, nents),
+	TP_STRUCT__entry(
+		__field(int, context_id)
+		__field(int, algorithm)
+		__field(size_t, len)
+		__field(int, nents)
+	),
+	TP_fast_assign(
+		__entry->context_id = context_id;
+		__entry->algorithm = algorithm;
+		__entry->len = len;
+		__entry->nents = nents;
+	),
+	TP_printk("context=%d algorithm=%d len=%zu pages=%d",
+		  __entry->context_id, __entry->algorithm, __entry->len,
+		  __entry->nents)
+);
+
+TRACE_EVENT(cryptiface_cipher_start,
+	TP_PROTO(int context_id, int algorithm, size_t len, bool encrypt),
+	TP_ARGS(context_id, algorithm, len, encrypt),
+	TP_STRUCT__entry(
+		__field(int, context_id)
+		__field(int, algorithm)
+		__field(size_t, len)
+		__field(bool, encrypt)
+	),
+	TP_fast_assign(
+		__entry->context_id = context_id;
+		__entry->algorithm = algorithm;
+		__entry->len = len;
+		__entry->encrypt = encrypt;
+	),
+	TP_printk("context=%d algorithm=%d len=%zu %s", __entry->context_id,
+		  __entry->algorithm, __entry->len,
+		  __entry->encrypt ? "encrypt" : "decrypt")
+);
+
+TRACE_EVENT(cryptiface_cipher_finish,
+	TP_PROTO(int context_id, int algorithm, size_t len, int err),
+	TP_ARGS(context_id, algorithm, len, err),
+	TP_STRUCT__entry(
+		__field(int, context_id)
+		__field(int, algorithm)
+		__field(size_t, len)
+		__field(int, err)
+	),
+	TP_fast_assign(
+		__entry->context_id = context_id;
+		__entry->algorithm = algorithm;
+		__entry->len = len;
+		__entry->err = err;
+	),
+	TP_printk("context=%d algorithm=%d len=%zu err=%d",
+		  __entry->context_id, __entry->algorithm, __entry->len,
+		  __entry->err)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE crypto_trace
+#include <trace/define_trace.h>
@@ -1,8 +1,15 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
 
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 #include <stddef.h>
 
@@ -26,6 +33,445 @@ void hexdump(const void *ptr, int buflen) {
   }
 }
 
+// above the parallel_threshold module parameter's default
+#define CTR_SIZE (1 << 20)
+#define CTR_CHUNK 4096
+
+static int
+read_all(int fd, char *buf, size_t len) {
+  size_t done = 0;
+  while(done < len) {
+    ssize_t n = read(fd, buf + done, len - done);
+    if(n <= 0) {
+      perror("read()");
+      return -1;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+// adds blocks to the big endian counter in iv
+static void
+advance_counter(unsigned char *iv, size_t size, unsigned long blocks) {
+  while(size > 0 && blocks > 0) {
+    size--;
+    blocks += iv[size];
+    iv[size] = blocks & 0xff;
+    blocks >>= 8;
+  }
+}
+
+// a whole pipe spliced in goes through crypt_parallel(), on more than one
+// CPU, rather than the pipeline write() uses, and has to give the same
+static int
+check_ctr_splice(int fd, const unsigned char *iv, const char *data,
+                 const char *expected) {
+  char *spliced = malloc(CTR_SIZE);
+  int pipefd[2] = { -1, -1 };
+  int ret = -1;
+
+  if(NULL == spliced || pipe(pipefd)) {
+    perror("aes-ctr splice setup");
+    goto out;
+  }
+  if(fcntl(pipefd[1], F_SETPIPE_SZ, CTR_SIZE) < CTR_SIZE) {
+    perror("pipe too small for a parallel splice, fcntl()");
+    ret = 0;
+    goto out;
+  }
+  if(write(pipefd[1], data, CTR_SIZE) != CTR_SIZE
+     || cryptiface_setiv(fd, iv, 16)
+     || splice(pipefd[0], NULL, fd, NULL, CTR_SIZE, 0) != CTR_SIZE
+     || read_all(fd, spliced, CTR_SIZE)) {
+    perror("aes-ctr splice");
+    goto out;
+  }
+  if(memcmp(expected, spliced, CTR_SIZE)) {
+    printf("aes-ctr: parallel splice differs from split write\n");
+    goto out;
+  }
+  printf("aes-ctr: parallel splice matches split write\n");
+  ret = 0;
+out:
+  if(-1 != pipefd[0]) {
+    close(pipefd[0]);
+    close(pipefd[1]);
+  }
+  free(spliced);
+  return ret;
+}
+
+// a write split over CPUs has to give what small writes give, each
+// started from the counter the previous one ended on
+static int
+check_ctr_split(int fd) {
+  const unsigned char iv[16] = { 0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6,
+                                 0xf7, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd,
+                                 0xfe, 0xf0 };
+  unsigned char chunk_iv[16];
+  char *data = malloc(CTR_SIZE), *big = malloc(CTR_SIZE),
+    *small = malloc(CTR_SIZE);
+  size_t i;
+  int key_id, ret = -1;
+
+  if(NULL == data || NULL == big || NULL == small) {
+    perror("malloc()");
+    goto out;
+  }
+  for(i = 0; i < CTR_SIZE; i++)
+    data[i] = i * 7 + (i >> 12);
+  key_id = cryptiface_addkey(fd, CRYPTIFACE_ALG_AES_CTR,
+                             "000102030405060708090a0b0c0d0e0f");
+  if(-1 == key_id) {
+    perror("aes-ctr unavailable, cryptiface_addkey()");
+    ret = 0;
+    goto out;
+  }
+  if(cryptiface_setcurrent(fd, CRYPTIFACE_ALG_AES_CTR, key_id, true)
+     || cryptiface_setiv(fd, iv, sizeof(iv))) {
+    perror("aes-ctr setup");
+    goto out;
+  }
+  if(write(fd, data, CTR_SIZE) != CTR_SIZE || read_all(fd, big, CTR_SIZE)) {
+    perror("aes-ctr big write");
+    goto out;
+  }
+
+  for(i = 0; i < CTR_SIZE; i += CTR_CHUNK) {
+    memcpy(chunk_iv, iv, sizeof(iv));
+    advance_counter(chunk_iv, sizeof(chunk_iv), i / sizeof(chunk_iv));
+    if(cryptiface_setiv(fd, chunk_iv, sizeof(chunk_iv))
+       || write(fd, data + i, CTR_CHUNK) != CTR_CHUNK) {
+      perror("aes-ctr small write");
+      goto out;
+    }
+  }
+  if(read_all(fd, small, CTR_SIZE)) {
+    goto out;
+  }
+  if(memcmp(big, small, CTR_SIZE)) {
+    printf("aes-ctr: split write differs from small writes\n");
+    goto out;
+  }
+  printf("aes-ctr: split write matches small writes\n");
+  if(check_ctr_splice(fd, iv, data, big)) {
+    goto out;
+  }
+  ret = 0;
+  cryptiface_delkey(fd, CRYPTIFACE_ALG_AES_CTR, key_id);
+out:
+  free(data);
+  free(big);
+  free(small);
+  return ret;
+}
+
+// DES takes whole 8 byte blocks and no IV, so every way of submitting
+// them has to give what a plain write gives
+#define DES_SIZE 32
+
+static int
+des_reference(int fd, int key_id, const char *in, char *out) {
+  if(cryptiface_setcurrent(fd, CRYPTIFACE_ALG_DES, key_id, true)
+     || write(fd, in, DES_SIZE) != DES_SIZE || read_all(fd, out, DES_SIZE)) {
+    perror("des reference");
+    return -1;
+  }
+  return 0;
+}
+
+// a ring entry is transformed in place in the shared data area with the
+// current key and direction
+static int
+check_ring(int fd, int key_id) {
+  char plain[DES_SIZE], expected[DES_SIZE];
+  struct __cryptiface_ring_header *header;
+  struct __cryptiface_sqe *sqe;
+  struct __cryptiface_cqe *cqe;
+  unsigned int mask;
+  size_t map_size;
+  char *map;
+  int ret = -1;
+
+  memset(plain, 'r', sizeof(plain));
+  if(des_reference(fd, key_id, plain, expected))
+    return -1;
+  if(cryptiface_ring_setup(fd, 4, 4096, &map_size)) {
+    perror("cryptiface_ring_setup()");
+    return -1;
+  }
+  map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(MAP_FAILED == map) {
+    perror("mmap()");
+    return -1;
+  }
+  header = (void *)map;
+  mask = header->entries - 1;
+  memcpy(map + header->data_offset, plain, DES_SIZE);
+  sqe = (struct __cryptiface_sqe *)(map + header->sq_offset)
+    + (header->sq_tail & mask);
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = 42;
+  sqe->len = DES_SIZE;
+  __atomic_store_n(&header->sq_tail, header->sq_tail + 1, __ATOMIC_RELEASE);
+  if(cryptiface_ring_enter(fd) < 0) {
+    perror("cryptiface_ring_enter()");
+    goto out;
+  }
+  if(__atomic_load_n(&header->cq_tail, __ATOMIC_ACQUIRE)
+     == header->cq_head) {
+    printf("ring: no completion\n");
+    goto out;
+  }
+  cqe = (struct __cryptiface_cqe *)(map + header->cq_offset)
+    + (header->cq_head & mask);
+  header->cq_head++;
+  if(cqe->user_data != 42 || cqe->res != 0
+     || memcmp(map + header->data_offset, expected, DES_SIZE)) {
+    printf("ring: entry differs from write, res %d\n", cqe->res);
+    goto out;
+  }
+  printf("ring: entry matches write\n");
+  ret = 0;
+out:
+  munmap(map, map_size);
+  return ret;
+}
+
+// one batch encrypts a buffer and decrypts the write's ciphertext
+static int
+check_batch(int fd, int key_id) {
+  char plain[DES_SIZE], expected[DES_SIZE], out[2][DES_SIZE];
+  struct __cryptiface_batch_entry entries[2];
+  int i;
+
+  memset(plain, 'b', sizeof(plain));
+  if(des_reference(fd, key_id, plain, expected))
+    return -1;
+  memset(entries, 0, sizeof(entries));
+  for(i = 0; i < 2; i++) {
+    entries[i].context_id = key_id;
+    entries[i].encrypt = i == 0;
+    entries[i].in = i == 0 ? plain : expected;
+    entries[i].out = out[i];
+    entries[i].len = DES_SIZE;
+  }
+  if(cryptiface_batch(fd, CRYPTIFACE_ALG_DES, entries, 2) != 2) {
+    perror("cryptiface_batch()");
+    return -1;
+  }
+  if(entries[0].result != DES_SIZE || entries[1].result != DES_SIZE
+     || memcmp(out[0], expected, DES_SIZE)
+     || memcmp(out[1], plain, DES_SIZE)) {
+    printf("batch: entries differ from write, results %ld %ld\n",
+           entries[0].result, entries[1].result);
+    return -1;
+  }
+  printf("batch: entries match write\n");
+  return 0;
+}
+
+// a non-blocking fd reports an empty queue instead of waiting on it, and
+// poll() tells when a result is ready
+static int
+check_nonblock(int fd, int key_id) {
+  char plain[DES_SIZE], expected[DES_SIZE], out[DES_SIZE];
+  struct pollfd pfd;
+  int ret = -1;
+
+  memset(plain, 'n', sizeof(plain));
+  if(des_reference(fd, key_id, plain, expected))
+    return -1;
+  pfd.fd = open("/dev/cryptiface", O_RDWR | O_NONBLOCK);
+  if(-1 == pfd.fd) {
+    perror("open(O_NONBLOCK)");
+    return -1;
+  }
+  if(read(pfd.fd, out, sizeof(out)) != -1 || errno != EAGAIN) {
+    printf("nonblock: read of an empty queue did not fail with EAGAIN\n");
+    goto out;
+  }
+  pfd.events = POLLIN | POLLOUT;
+  if(poll(&pfd, 1, 0) != 1 || pfd.revents != POLLOUT) {
+    printf("nonblock: empty queue polls %#x\n", pfd.revents);
+    goto out;
+  }
+  if(cryptiface_setcurrent(pfd.fd, CRYPTIFACE_ALG_DES, key_id, true)
+     || write(pfd.fd, plain, DES_SIZE) != DES_SIZE) {
+    perror("nonblock write");
+    goto out;
+  }
+  pfd.events = POLLIN;
+  if(poll(&pfd, 1, 1000) != 1 || !(pfd.revents & POLLIN)) {
+    printf("nonblock: result never polled readable\n");
+    goto out;
+  }
+  if(read(pfd.fd, out, sizeof(out)) != DES_SIZE
+     || memcmp(out, expected, DES_SIZE)) {
+    printf("nonblock: result differs from blocking write\n");
+    goto out;
+  }
+  printf("nonblock: poll and read match blocking write\n");
+  ret = 0;
+out:
+  close(pfd.fd);
+  return ret;
+}
+
+// with CRYPTIFACE_F_COALESCE one read() takes two finished results
+static int
+check_coalesce(int fd, int key_id) {
+  char plain[DES_SIZE], expected[DES_SIZE], out[DES_SIZE];
+  ssize_t len;
+  int ret = -1;
+
+  memset(plain, 'c', sizeof(plain));
+  if(des_reference(fd, key_id, plain, expected))
+    return -1;
+  if(cryptiface_setflags(fd, CRYPTIFACE_F_COALESCE)) {
+    perror("cryptiface_setflags()");
+    return -1;
+  }
+  if(write(fd, plain, DES_SIZE / 2) != DES_SIZE / 2
+     || write(fd, plain + DES_SIZE / 2, DES_SIZE / 2) != DES_SIZE / 2) {
+    perror("coalesce write");
+    goto out;
+  }
+  len = read(fd, out, sizeof(out));
+  if(len != DES_SIZE || memcmp(out, expected, DES_SIZE)) {
+    printf("coalesce: read of two results gave %zd bytes\n", len);
+    if(len > 0 && len < DES_SIZE)
+      read_all(fd, out + len, DES_SIZE - len);
+    goto out;
+  }
+  printf("coalesce: one read takes both results\n");
+  ret = 0;
+out:
+  cryptiface_setflags(fd, 0);
+  return ret;
+}
+
+static int
+expect_resultstat(int fd, int count, size_t bytes, size_t head_size) {
+  struct __cryptiface_resultstat_op stat;
+  if(cryptiface_resultstat(fd, &stat)) {
+    perror("cryptiface_resultstat()");
+    return -1;
+  }
+  if(stat.count != count || stat.bytes != bytes
+     || stat.head_size != head_size) {
+    printf("resultstat: %d results, %zu bytes, head %zu, expected "
+           "%d, %zu, %zu\n", stat.count, stat.bytes, stat.head_size,
+           count, bytes, head_size);
+    return -1;
+  }
+  return 0;
+}
+
+// RESULTSTAT follows two queued results through a partial read
+static int
+check_resultstat(int fd, int key_id) {
+  char plain[DES_SIZE], expected[DES_SIZE], out[DES_SIZE];
+
+  memset(plain, 's', sizeof(plain));
+  if(des_reference(fd, key_id, plain, expected))
+    return -1;
+  if(expect_resultstat(fd, 0, 0, 0))
+    return -1;
+  if(write(fd, plain, 8) != 8
+     || write(fd, plain + 8, DES_SIZE - 8) != DES_SIZE - 8) {
+    perror("resultstat write");
+    return -1;
+  }
+  if(expect_resultstat(fd, 2, DES_SIZE, 8))
+    return -1;
+  if(read(fd, out, 4) != 4) {
+    perror("resultstat read");
+    return -1;
+  }
+  if(expect_resultstat(fd, 2, DES_SIZE - 4, 4)
+     || read_all(fd, out + 4, DES_SIZE - 4)
+     || expect_resultstat(fd, 0, 0, 0))
+    return -1;
+  if(memcmp(out, expected, DES_SIZE)) {
+    printf("resultstat: results differ from one write\n");
+    return -1;
+  }
+  printf("resultstat: follows the queue\n");
+  return 0;
+}
+
+// with CRYPTIFACE_F_TAGGED a result comes back behind the cookie of its
+// write
+static int
+check_tagged(int fd, int key_id) {
+  char plain[DES_SIZE], expected[DES_SIZE];
+  char in[sizeof(__u64) + DES_SIZE];
+  char out[sizeof(struct __cryptiface_tag) + DES_SIZE];
+  struct __cryptiface_tag tag;
+  __u64 cookie = 0x1122334455667788ULL;
+  int ret = -1;
+
+  memset(plain, 't', sizeof(plain));
+  if(des_reference(fd, key_id, plain, expected))
+    return -1;
+  if(cryptiface_setflags(fd, CRYPTIFACE_F_TAGGED)) {
+    perror("cryptiface_setflags()");
+    return -1;
+  }
+  memcpy(in, &cookie, sizeof(cookie));
+  memcpy(in + sizeof(cookie), plain, DES_SIZE);
+  if(write(fd, in, sizeof(in)) != sizeof(in)
+     || read(fd, out, sizeof(out)) != sizeof(out)) {
+    perror("tagged write and read");
+    goto out;
+  }
+  memcpy(&tag, out, sizeof(tag));
+  if(tag.cookie != cookie || tag.status != 0 || tag.len != DES_SIZE
+     || memcmp(out + sizeof(tag), expected, DES_SIZE)) {
+    printf("tagged: result differs from plain write, status %d len %u\n",
+           tag.status, tag.len);
+    goto out;
+  }
+  printf("tagged: result comes back behind its cookie\n");
+  ret = 0;
+out:
+  cryptiface_setflags(fd, 0);
+  return ret;
+}
+
+// STATS counts a write and its bytes for the algorithm; other users of
+// the module may add to the counters meanwhile
+static int
+check_stats(int fd, int key_id) {
+  char plain[DES_SIZE], out[DES_SIZE];
+  struct __cryptiface_stats before, after;
+  struct __cryptiface_alg_stats *b, *a;
+
+  memset(plain, 'S', sizeof(plain));
+  if(cryptiface_stats(fd, &before)
+     || des_reference(fd, key_id, plain, out)
+     || cryptiface_stats(fd, &after)) {
+    perror("cryptiface_stats()");
+    return -1;
+  }
+  b = &before.algorithms[CRYPTIFACE_ALG_DES];
+  a = &after.algorithms[CRYPTIFACE_ALG_DES];
+  if(after.header.version != CRYPTIFACE_STATS_VERSION
+     || after.header.size != sizeof(after)
+     || a->encrypt_ops < b->encrypt_ops + 1
+     || a->encrypt_bytes < b->encrypt_bytes + DES_SIZE) {
+    printf("stats: version %u size %u, des encrypt ops %llu -> %llu\n",
+           after.header.version, after.header.size,
+           (unsigned long long)b->encrypt_ops,
+           (unsigned long long)a->encrypt_ops);
+    return -1;
+  }
+  printf("stats: count the write\n");
+  return 0;
+}
+
 int
 main(int argc, char **argv) {
   int fd = open("/dev/cryptiface", O_RDWR);
@@ -93,5 +539,14 @@ main(int argc, char **argv) {
   printf("decrypted:\n");
   hexdump(clear_buf, len);
 
+  if(check_ctr_split(fd)
+     || check_ring(fd, key_id)
+     || check_batch(fd, key_id)
+     || check_nonblock(fd, key_id)
+     || check_coalesce(fd, key_id)
+     || check_resultstat(fd, key_id)
+     || check_tagged(fd, key_id)
+     || check_stats(fd, key_id))
+    return -1;
   return 0;
 }